@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+// Load generator: opens many IRCClient connections to a server, joins them
+// to the same channels and has every one of them send PRIVMSGs, either at a
+// fixed rate or as fast as the server drains them. Each message carries the
+// time it was sent, so the other clients in the channel measure delivery
+// latency. Prints throughput and latency every second and a summary at the
+// end, reconnecting clients the server drops.
+//
+//   loadgen host port [clients=n] [channels=#a,#b] [rate=messages/s]
+//           [size=bytes] [duration=s] [nick=prefix]
+//
+// rate is per client, 0 sends whenever the client's send queue is below
+// LOADGEN_QUEUE_LIMIT bytes, i.e. as fast as the server's throttle allows.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "IRCClient.h"
+
+#define LOADGEN_QUEUE_LIMIT 4096
+// Milliseconds before a dropped client connects again
+#define LOADGEN_RECONNECT_DELAY 1000
+#define LOADGEN_TAG "lg"
+
+typedef std::chrono::steady_clock Clock;
+
+struct LoadGenOptions
+{
+    std::string host;
+    int port;
+    unsigned clients;
+    std::vector<std::string> channels;
+    double rate;
+    size_t size;
+    unsigned duration;
+    std::string nick;
+};
+
+struct LoadGenClient
+{
+    unsigned index;
+    IRCClient client;
+    std::thread thread;
+    // Channels joined on the current connection
+    unsigned joined;
+    uint64_t seq;
+
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> reconnects;
+    // Delivery latencies in ns since the last report
+    std::mutex lock;
+    std::vector<uint64_t> latencies;
+};
+
+static LoadGenOptions options;
+static volatile sig_atomic_t running = 1;
+static Clock::time_point startTime;
+
+static void SignalHandler(int)
+{
+    running = 0;
+}
+
+static uint64_t Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - startTime).count();
+}
+
+static void OnEvent(IRCEvent const &event, IRCMessage const & /*message*/, IRCClient *client, void *context)
+{
+    LoadGenClient *state = static_cast<LoadGenClient *>(context);
+    if (IRCNumericEvent const *numeric = std::get_if<IRCNumericEvent>(&event))
+    {
+        if (numeric->code == 1)
+            for (auto &channel : options.channels)
+                client->SendIRC("JOIN ", channel);
+        return;
+    }
+    if (IRCJoinEvent const *join = std::get_if<IRCJoinEvent>(&event))
+    {
+        if (join->nick == client->GetNick())
+            ++state->joined;
+        return;
+    }
+    IRCPrivMsgEvent const *privmsg = std::get_if<IRCPrivMsgEvent>(&event);
+    if (!privmsg)
+        return;
+
+    // "lg <sender> <seq> <ns> padding"
+    std::string_view text = privmsg->text;
+    if (text.compare(0, sizeof(LOADGEN_TAG), LOADGEN_TAG " ") != 0)
+        return;
+    char const *p = text.data() + sizeof(LOADGEN_TAG);
+    char *end;
+    strtoul(p, &end, 10);
+    strtoull(end, &end, 10);
+    uint64_t sentAt = strtoull(end, &end, 10);
+    uint64_t now    = Now();
+    ++state->received;
+    std::lock_guard<std::mutex> guard(state->lock);
+    state->latencies.push_back(now > sentAt ? now - sentAt : 0);
+}
+
+static bool Connect(LoadGenClient &state)
+{
+    state.joined = 0;
+    std::string nick = options.nick + std::to_string(state.index);
+    return state.client.InitSocket() && state.client.Connect(options.host.c_str(), options.port) && state.client.Login(nick, nick);
+}
+
+static void SendOne(LoadGenClient &state, std::string &line)
+{
+    std::string const &channel = options.channels[state.seq % options.channels.size()];
+    line.assign(LOADGEN_TAG " ");
+    line += std::to_string(state.index) + ' ' + std::to_string(state.seq) + ' ' + std::to_string(Now()) + ' ';
+    if (line.size() < options.size)
+        line.append(options.size - line.size(), 'x');
+    if (state.client.SendIRC("PRIVMSG ", channel, " :", line))
+    {
+        ++state.seq;
+        ++state.sent;
+    }
+}
+
+static void RunClient(LoadGenClient *state)
+{
+    state->client.HookIRCEvent(state, OnEvent);
+    std::string line;
+    bool connected       = Connect(*state);
+    Clock::time_point retry = Clock::now();
+    // Sends are paced from the moment all channels are joined
+    Clock::time_point paceStart;
+    uint64_t paceBase = 0;
+    bool pacing       = false;
+
+    while (running)
+    {
+        if (!connected || !state->client.Connected())
+        {
+            pacing = false;
+            if (connected)
+            {
+                state->client.Disconnect();
+                connected = false;
+                retry     = Clock::now() + std::chrono::milliseconds(LOADGEN_RECONNECT_DELAY);
+            }
+            if (Clock::now() < retry)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            ++state->reconnects;
+            connected = Connect(*state);
+            if (!connected)
+                retry = Clock::now() + std::chrono::milliseconds(LOADGEN_RECONNECT_DELAY);
+            continue;
+        }
+
+        int timeout = 100;
+        if (state->joined >= options.channels.size())
+        {
+            if (!pacing)
+            {
+                pacing    = true;
+                paceStart = Clock::now();
+                paceBase  = state->seq;
+            }
+            if (options.rate > 0)
+            {
+                double elapsed = std::chrono::duration<double>(Clock::now() - paceStart).count();
+                uint64_t due   = paceBase + uint64_t(elapsed * options.rate);
+                while (state->seq < due && state->client.GetSendQueued() < LOADGEN_QUEUE_LIMIT)
+                    SendOne(*state, line);
+                timeout = std::max(1, int(1000 / options.rate));
+            }
+            else
+            {
+                while (state->client.GetSendQueued() < LOADGEN_QUEUE_LIMIT)
+                    SendOne(*state, line);
+                timeout = 1;
+            }
+        }
+        state->client.ReceiveData(timeout);
+    }
+    if (connected)
+        state->client.Quit("loadgen done", 1000);
+}
+
+static uint64_t Percentile(std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+static void Report(char const *label, double seconds, uint64_t sent, uint64_t received, uint64_t reconnects, std::vector<uint64_t> &latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-6s %10.0f %10.0f %9.2f %9.2f %9.2f %9.2f %6llu\n", label, sent / seconds, received / seconds, Percentile(latencies, 0.5) / 1e6, Percentile(latencies, 0.9) / 1e6, Percentile(latencies, 0.99) / 1e6, latencies.empty() ? 0.0 : latencies.back() / 1e6, (unsigned long long) reconnects);
+    fflush(stdout);
+}
+
+static bool ParseOptions(int argc, char *argv[])
+{
+    if (argc < 3)
+        return false;
+    options.host     = argv[1];
+    options.port     = atoi(argv[2]);
+    options.clients  = 10;
+    options.channels = { "#loadgen" };
+    options.rate     = 1;
+    options.size     = 64;
+    options.duration = 10;
+    options.nick     = "lg";
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg(argv[i]);
+        size_t equals = arg.find('=');
+        if (equals == std::string::npos)
+            return false;
+        std::string name  = arg.substr(0, equals);
+        std::string value = arg.substr(equals + 1);
+        if (name == "clients")
+            options.clients = std::max(1, atoi(value.c_str()));
+        else if (name == "channels")
+            options.channels = split(value, ',');
+        else if (name == "rate")
+            options.rate = atof(value.c_str());
+        else if (name == "size")
+            options.size = strtoul(value.c_str(), NULL, 10);
+        else if (name == "duration")
+            options.duration = strtoul(value.c_str(), NULL, 10);
+        else if (name == "nick")
+            options.nick = value;
+        else
+            return false;
+    }
+    return options.port > 0 && !options.channels.empty();
+}
+
+int main(int argc, char *argv[])
+{
+    if (!ParseOptions(argc, argv))
+    {
+        fprintf(stderr, "usage: %s host port [clients=n] [channels=#a,#b] [rate=messages/s] [size=bytes] [duration=s] [nick=prefix]\n", argv[0]);
+        return 2;
+    }
+    signal(SIGINT, SignalHandler);
+    // The default handlers print every message, keep the console clean
+    std::cout.rdbuf(NULL);
+    startTime = Clock::now();
+
+    std::vector<std::unique_ptr<LoadGenClient>> clients;
+    for (unsigned i = 0; i < options.clients; ++i)
+    {
+        clients.emplace_back(new LoadGenClient());
+        LoadGenClient &state = *clients.back();
+        state.index          = i;
+        state.joined         = 0;
+        state.seq            = 0;
+        state.sent           = 0;
+        state.received       = 0;
+        state.reconnects     = 0;
+        state.thread         = std::thread(RunClient, &state);
+    }
+
+    printf("%-6s %10s %10s %9s %9s %9s %9s %6s\n", "time", "sent/s", "recv/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "recon");
+    uint64_t lastSent = 0, lastReceived = 0;
+    std::vector<uint64_t> total, interval;
+    for (unsigned second = 1; running && second <= options.duration; ++second)
+    {
+        std::this_thread::sleep_until(startTime + std::chrono::seconds(second));
+        uint64_t sent = 0, received = 0, reconnects = 0;
+        interval.clear();
+        for (auto &state : clients)
+        {
+            sent += state->sent;
+            received += state->received;
+            reconnects += state->reconnects;
+            std::lock_guard<std::mutex> guard(state->lock);
+            interval.insert(interval.end(), state->latencies.begin(), state->latencies.end());
+            state->latencies.clear();
+        }
+        total.insert(total.end(), interval.begin(), interval.end());
+        char label[16];
+        snprintf(label, sizeof(label), "%us", second);
+        Report(label, 1.0, sent - lastSent, received - lastReceived, reconnects, interval);
+        lastSent     = sent;
+        lastReceived = received;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+    running        = 0;
+    uint64_t reconnects = 0;
+    for (auto &state : clients)
+    {
+        state->thread.join();
+        reconnects += state->reconnects;
+    }
+    Report("total", seconds, lastSent, lastReceived, reconnects, total);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+// Runs IRCClient's receive path over two kinds of traffic once per scanner
+// kernel: short chat lines, and the long 353 replies of a NAMES burst. It
+// reports the scan alone in bytes per ns and the whole path, scan, parse and
+// dispatch, in ns per line.
+//
+//   scanbench [megabytes per run]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "IRCClient.h"
+#include "IRCScan.h"
+
+static std::string ChatLines()
+{
+    return ":alice!alice@host.example.org PRIVMSG #chat :the quick brown fox jumps over the lazy dog\r\n"
+           ":bob!~bob@10.0.0.1 PRIVMSG #chat :lol\r\n"
+           ":carol!carol@users.example.net NOTICE #chat :short notice\r\n";
+}
+
+static std::string NamesBurst()
+{
+    std::string burst;
+    for (int line = 0; line < 8; ++line)
+    {
+        std::string names = ":irc.example.org 353 me = #big :";
+        for (int nick = 0; names.size() < 480; ++nick)
+            names += (nick % 7 ? "" : "@") + std::string("member") + std::to_string(line * 100 + nick) + ' ';
+        burst += names + "\r\n";
+    }
+    return burst + ":irc.example.org 366 me #big :End of /NAMES list.\r\n";
+}
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void Run(char const *kernel, char const *traffic, std::string const &sample, size_t bytes)
+{
+    // Receive sized chunks that end on a line, like a busy socket delivers
+    std::string chunk;
+    while (chunk.size() + sample.size() <= 4096)
+        chunk += sample;
+    size_t lines = 0;
+    for (char c : chunk)
+        lines += c == '\n';
+    size_t rounds = bytes / chunk.size() + 1;
+
+    std::vector<uint16_t> offsets(chunk.size());
+    size_t found = 0;
+    auto start   = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; ++i)
+        found += IRCScan::Delimiters(chunk.data(), chunk.size(), offsets.data());
+    double scan = Seconds(start);
+
+    IRCClient client;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; ++i)
+        client.ProcessData(chunk.data(), chunk.size());
+    double parse = Seconds(start);
+
+    printf("%-7s %-6s %12.2f %12.1f %10zu\n", kernel, traffic, rounds * chunk.size() / scan / 1e9, parse * 1e9 / (rounds * lines), found / rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    static char const *kernels[] = { "scalar", "sse2", "avx2" };
+
+    printf("%-7s %-6s %12s %12s %10s\n", "kernel", "lines", "scan B/ns", "path ns/ln", "delims");
+    // The default handlers print every message, keep the console clean
+    std::cout.rdbuf(NULL);
+    std::string chat  = ChatLines();
+    std::string names = NamesBurst();
+    for (int kernel = IRC_SCAN_SCALAR; kernel <= IRC_SCAN_AVX2; ++kernel)
+    {
+        if (!IRCScan::Select(static_cast<IRCScanKernel>(kernel)))
+        {
+            printf("%-7s not supported here\n", kernels[kernel]);
+            continue;
+        }
+        Run(kernels[kernel], "chat", chat, megabytes << 20);
+        Run(kernels[kernel], "names", names, megabytes << 20);
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+// Streams PRIVMSGs from a loopback server through IRCClient once per socket
+// backend and reports system calls and CPU time per message.
+//
+//   socketbench [messages] [reply every n messages, 0 for never]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <arpa/inet.h>
+#include "IRCClient.h"
+
+struct BenchState
+{
+    unsigned long received;
+    unsigned long replyEvery;
+};
+
+static void OnPrivMsg(IRCMessage const & /*message*/, IRCClient *client, void *context)
+{
+    BenchState *state = static_cast<BenchState *>(context);
+    if (state->replyEvery && ++state->received % state->replyEvery == 0)
+        client->SendIRC("PRIVMSG #bench :ack");
+    else if (!state->replyEvery)
+        ++state->received;
+}
+
+static int Listen(int &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len        = sizeof(addr);
+    if (fd == -1 || bind(fd, (sockaddr *) &addr, sizeof(addr)) || listen(fd, 1) || getsockname(fd, (sockaddr *) &addr, &len))
+        return -1;
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Writes all messages in large chunks and throws away whatever comes back
+static void Serve(int listener, unsigned long messages)
+{
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1)
+        return;
+    std::thread drain([fd]() {
+        char buffer[4096];
+        while (recv(fd, buffer, sizeof(buffer), 0) > 0)
+            ;
+    });
+
+    std::string line = ":bench!bench@localhost PRIVMSG #bench :the quick brown fox jumps over the lazy dog\r\n";
+    std::string chunk;
+    while (chunk.size() < 65536)
+        chunk += line;
+    unsigned long perChunk = chunk.size() / line.size();
+    for (unsigned long sent = 0; sent < messages; sent += perChunk)
+    {
+        size_t length = (messages - sent < perChunk ? messages - sent : perChunk) * line.size();
+        for (size_t done = 0; done < length;)
+        {
+            ssize_t n = send(fd, chunk.data() + done, length - done, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+    }
+    drain.join();
+    close(fd);
+}
+
+static double ThreadCpu()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool Run(IRCSocketBackend backend, char const *name, unsigned long messages, unsigned long replyEvery)
+{
+    int port;
+    int listener = Listen(port);
+    if (listener == -1)
+        return false;
+    std::thread server(Serve, listener, messages);
+
+    BenchState state = { 0, replyEvery };
+    IRCClient client;
+    client.SetSocketBackend(backend);
+    client.HookIRCCommand("PRIVMSG", &state, OnPrivMsg);
+    if (!client.InitSocket() || !client.Connect("127.0.0.1", port))
+    {
+        server.join();
+        close(listener);
+        return false;
+    }
+
+    // The first Wait() sets up the ring, keep that out of the numbers
+    client.ReceiveData(0);
+    uint64_t syscalls = client.GetSocketSyscalls();
+    double cpu        = ThreadCpu();
+    auto start        = std::chrono::steady_clock::now();
+    while (state.received < messages && client.Connected())
+        client.ReceiveData();
+    double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cpu         = ThreadCpu() - cpu;
+    syscalls    = client.GetSocketSyscalls() - syscalls;
+
+    printf("%-9s %9lu %9llu %9.4f %11.1f %9.1f\n", client.GetSocketBackend() == backend ? name : "fallback", state.received, (unsigned long long) syscalls, (double) syscalls / state.received, cpu / state.received, wall);
+
+    client.Disconnect();
+    server.join();
+    close(listener);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long messages   = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    unsigned long replyEvery = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+    printf("%-9s %9s %9s %9s %11s %9s\n", "backend", "messages", "syscalls", "per msg", "cpu ns/msg", "wall ms");
+    // The default handlers print every message, keep the console clean
+    std::cout.rdbuf(NULL);
+    Run(IRC_BACKEND_POLL, "poll", messages, replyEvery);
+    if (IRCUring::Supported())
+        Run(IRC_BACKEND_URING, "io_uring", messages, replyEvery);
+    else
+        printf("io_uring is not supported here\n");
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include <cstdint>
+#include <new>
+#include "IRCArena.h"
+
+IRCArena::IRCArena(size_t blockSize) : _current(0), _ptr(NULL), _end(NULL), _blockSize(blockSize), _used(0), _capacity(0)
+{
+}
+
+IRCArena::~IRCArena()
+{
+    for (Block &block : _blocks)
+        ::operator delete(block.data);
+}
+
+void IRCArena::Reset()
+{
+    _current = 0;
+    _used    = 0;
+    if (_blocks.empty())
+    {
+        _ptr = _end = NULL;
+        return;
+    }
+    _ptr = _blocks[0].data;
+    _end = _ptr + _blocks[0].size;
+}
+
+static char *AlignUp(char *ptr, size_t alignment)
+{
+    uintptr_t value = reinterpret_cast<uintptr_t>(ptr);
+    return reinterpret_cast<char *>((value + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+bool IRCArena::NextBlock(size_t bytes, size_t alignment)
+{
+    // Reuse a block retained from a previous batch if it is large enough
+    while (_current + 1 < _blocks.size())
+    {
+        Block &block = _blocks[++_current];
+        if (block.size >= bytes + alignment)
+        {
+            _ptr = block.data;
+            _end = block.data + block.size;
+            return true;
+        }
+    }
+
+    size_t size = bytes + alignment > _blockSize ? bytes + alignment : _blockSize;
+    Block block;
+    block.data = static_cast<char *>(::operator new(size, std::nothrow));
+    if (!block.data)
+        return false;
+    block.size = size;
+    _capacity += size;
+    _blocks.push_back(block);
+    _current = _blocks.size() - 1;
+    _ptr     = block.data;
+    _end     = block.data + size;
+    return true;
+}
+
+void *IRCArena::do_allocate(size_t bytes, size_t alignment)
+{
+    char *aligned = _ptr ? AlignUp(_ptr, alignment) : NULL;
+    if (!aligned || aligned + bytes > _end)
+    {
+        if (!NextBlock(bytes, alignment))
+            throw std::bad_alloc();
+        aligned = AlignUp(_ptr, alignment);
+    }
+    _used += (aligned - _ptr) + bytes;
+    _ptr = aligned + bytes;
+    return aligned;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCARENA_H
+#define _IRCARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+#define IRC_ARENA_BLOCK_SIZE 16384
+
+// Bump allocator backing everything parsed out of one receive batch.
+// Deallocation is a no-op, Reset() rewinds to the first block in O(1) and
+// keeps every block around, so a warmed up connection stops calling malloc.
+class IRCArena : public std::pmr::memory_resource
+{
+public:
+    explicit IRCArena(size_t blockSize = IRC_ARENA_BLOCK_SIZE);
+    ~IRCArena();
+
+    IRCArena(IRCArena const &) = delete;
+    IRCArena &operator=(IRCArena const &) = delete;
+
+    void Reset();
+
+    // Bytes handed out since the last Reset()
+    size_t Used() const
+    {
+        return _used;
+    };
+    // Bytes owned by the arena across all blocks
+    size_t Capacity() const
+    {
+        return _capacity;
+    };
+
+private:
+    struct Block
+    {
+        char *data;
+        size_t size;
+    };
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *, size_t, size_t) override{};
+    bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override
+    {
+        return this == &other;
+    };
+
+    bool NextBlock(size_t bytes, size_t alignment);
+
+    std::vector<Block> _blocks;
+    size_t _current;
+    char *_ptr;
+    char *_end;
+    size_t _blockSize;
+    size_t _used;
+    size_t _capacity;
+};
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include "IRCCapture.h"
+#include "IRCClient.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t CaptureTimestamp()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool IRCCapture::Open(char const *path)
+{
+    Close();
+
+    _fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd == -1)
+    {
+        std::cout << "IRC: Unable to open capture " << path << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) == -1 || !Map(st.st_size > (off_t) sizeof(IRCCaptureHeader) ? st.st_size : IRC_CAPTURE_GROW_SIZE))
+    {
+        Close();
+        return false;
+    }
+
+    IRCCaptureHeader *header = reinterpret_cast<IRCCaptureHeader *>(_map);
+    if (memcmp(header->magic, IRC_CAPTURE_MAGIC, sizeof(header->magic)) != 0 || header->used < sizeof(IRCCaptureHeader) || header->used > _mapSize)
+    {
+        memcpy(header->magic, IRC_CAPTURE_MAGIC, sizeof(header->magic));
+        header->used = sizeof(IRCCaptureHeader);
+    }
+    return true;
+}
+
+void IRCCapture::Close()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_map)
+    {
+        // Trim the preallocated tail so the file only holds records
+        size_t used = reinterpret_cast<IRCCaptureHeader *>(_map)->used;
+        munmap(_map, _mapSize);
+        if (ftruncate(_fd, used) == -1)
+            std::cout << "IRC: Unable to trim capture" << std::endl;
+        _map = NULL;
+    }
+    if (_fd != -1)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+    _mapSize = 0;
+}
+
+bool IRCCapture::Map(size_t size)
+{
+    if (ftruncate(_fd, size) == -1)
+        return false;
+    if (_map)
+        munmap(_map, _mapSize);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        _map     = NULL;
+        _mapSize = 0;
+        std::cout << "IRC: Unable to map capture" << std::endl;
+        return false;
+    }
+    _map     = static_cast<char *>(map);
+    _mapSize = size;
+    return true;
+}
+
+void IRCCapture::Append(IRCCaptureDirection direction, char const *data, size_t length)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    if (!_map)
+        return;
+
+    size_t used   = reinterpret_cast<IRCCaptureHeader *>(_map)->used;
+    size_t needed = used + sizeof(IRCCaptureRecord) + length;
+    if (needed > _mapSize)
+    {
+        size_t size = _mapSize;
+        while (size < needed)
+            size += size < IRC_CAPTURE_GROW_SIZE * 16 ? size : IRC_CAPTURE_GROW_SIZE * 16;
+        if (!Map(size))
+            return;
+    }
+
+    IRCCaptureRecord record;
+    record.timestamp = CaptureTimestamp();
+    record.length    = length;
+    record.direction = direction;
+    memcpy(_map + used, &record, sizeof(record));
+    memcpy(_map + used + sizeof(record), data, length);
+    // Publish the record only once it is complete
+    reinterpret_cast<IRCCaptureHeader *>(_map)->used = needed;
+}
+
+bool IRCReplay::Open(char const *path)
+{
+    Close();
+
+    _fd = open(path, O_RDONLY);
+    struct stat st;
+    if (_fd == -1 || fstat(_fd, &st) == -1 || st.st_size < (off_t) sizeof(IRCCaptureHeader))
+    {
+        std::cout << "IRC: Unable to open capture " << path << std::endl;
+        Close();
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    _map  = static_cast<char *>(map);
+    _size = st.st_size;
+
+    IRCCaptureHeader const *header = reinterpret_cast<IRCCaptureHeader const *>(_map);
+    if (memcmp(header->magic, IRC_CAPTURE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        std::cout << "IRC: " << path << " is not a capture" << std::endl;
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void IRCReplay::Close()
+{
+    if (_map)
+    {
+        munmap(_map, _size);
+        _map = NULL;
+    }
+    if (_fd != -1)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+    _size = 0;
+}
+
+size_t IRCReplay::Run(IRCClient &client, bool realtime)
+{
+    if (!_map)
+        return 0;
+
+    size_t used                                 = reinterpret_cast<IRCCaptureHeader const *>(_map)->used;
+    size_t end                                  = used < _size ? used : _size;
+    size_t chunks                               = 0;
+    size_t offset                               = sizeof(IRCCaptureHeader);
+    uint64_t first                              = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    while (offset + sizeof(IRCCaptureRecord) <= end)
+    {
+        IRCCaptureRecord record;
+        memcpy(&record, _map + offset, sizeof(record));
+        offset += sizeof(record);
+        if (offset + record.length > end)
+            break;
+
+        if (record.direction == IRC_CAPTURE_RECV)
+        {
+            if (!first)
+                first = record.timestamp;
+            if (realtime)
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.timestamp - first));
+            client.ProcessData(_map + offset, record.length);
+            ++chunks;
+        }
+        offset += record.length;
+    }
+    return chunks;
+}
+
+#else
+
+bool IRCCapture::Open(char const *path)
+{
+    std::cout << "IRC: Captures are not supported on this platform" << std::endl;
+    return false;
+}
+
+void IRCCapture::Close()
+{
+}
+
+void IRCCapture::Append(IRCCaptureDirection direction, char const *data, size_t length)
+{
+}
+
+bool IRCReplay::Open(char const *path)
+{
+    std::cout << "IRC: Captures are not supported on this platform" << std::endl;
+    return false;
+}
+
+void IRCReplay::Close()
+{
+}
+
+size_t IRCReplay::Run(IRCClient &client, bool realtime)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCCAPTURE_H
+#define _IRCCAPTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+class IRCClient;
+
+#define IRC_CAPTURE_MAGIC "IRCCAP1"
+#define IRC_CAPTURE_GROW_SIZE (1 << 20)
+
+enum IRCCaptureDirection
+{
+    IRC_CAPTURE_RECV = 0,
+    IRC_CAPTURE_SEND = 1
+};
+
+// On disk layout: one IRCCaptureHeader followed by records, each an
+// IRCCaptureRecord immediately followed by its payload.
+struct IRCCaptureHeader
+{
+    char magic[8];
+    // Bytes used by header and records, the file may be larger
+    uint64_t used;
+};
+
+struct IRCCaptureRecord
+{
+    // steady_clock time in nanoseconds
+    uint64_t timestamp;
+    uint32_t length;
+    uint32_t direction;
+};
+
+// Memory mapped, append-only log of everything sent and received
+class IRCCapture
+{
+public:
+    IRCCapture() : _fd(-1), _map(NULL), _mapSize(0){};
+    ~IRCCapture()
+    {
+        Close();
+    };
+
+    IRCCapture(IRCCapture const &) = delete;
+    IRCCapture &operator=(IRCCapture const &) = delete;
+
+    // Appends to an existing capture or creates a new one
+    bool Open(char const * /*path*/);
+    void Close();
+    bool IsOpen() const
+    {
+        return _map != NULL;
+    };
+
+    void Append(IRCCaptureDirection /*direction*/, char const * /*data*/, size_t /*length*/);
+
+private:
+    bool Map(size_t /*size*/);
+
+    int _fd;
+    char *_map;
+    size_t _mapSize;
+    // Sends and receives happen on different threads
+    std::mutex _lock;
+};
+
+// Feeds the received chunks of a capture back into a client
+class IRCReplay
+{
+public:
+    IRCReplay() : _fd(-1), _map(NULL), _size(0){};
+    ~IRCReplay()
+    {
+        Close();
+    };
+
+    IRCReplay(IRCReplay const &) = delete;
+    IRCReplay &operator=(IRCReplay const &) = delete;
+
+    bool Open(char const * /*path*/);
+    void Close();
+
+    // Replays at the original pace if realtime is set, as fast as possible
+    // otherwise. Returns the number of chunks fed to the client.
+    size_t Run(IRCClient & /*client*/, bool realtime);
+
+private:
+    int _fd;
+    char *_map;
+    size_t _size;
+};
+
+#endif
@@ -15,9 +15,11 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cstring>
 #include "IRCSocket.h"
 #include "IRCClient.h"
 #include "IRCHandler.h"
+#include "IRCScan.h"
 
 std::vector<std::string> split(std::string const &text, char sep)
 {
@@ -34,6 +36,14 @@ std::vector<std::string> split(std::string const &text, char sep)
 
 bool IRCClient::InitSocket()
 {
+    _registered     = false;
+    _capOffered     = 0;
+    _capEnabled     = 0;
+    _capNegotiating = false;
+    // Nothing of the previous connection's last line belongs to this one
+    _recvLength     = 0;
+    _recvDiscarding = false;
+    _lag.Reset();
     return _socket.Init();
 }
 
@@ -47,86 +57,350 @@ void IRCClient::Disconnect()
     _socket.Disconnect();
 }
 
-bool IRCClient::SendIRC(std::string data)
+void IRCClient::Quit(std::string message, int timeout)
 {
-    data.append("\n");
-    return _socket.SendData(data.c_str());
+    if (!Connected())
+        return;
+    SendIRC("QUIT :", message);
+    _socket.Flush(timeout);
+    Disconnect();
 }
 
 bool IRCClient::Login(std::string nick, std::string user, std::string password)
 {
     _nick = nick;
     _user = user;
+    {
+        std::lock_guard<std::mutex> lock(_nickLock);
+        _loginNick    = nick;
+        _nickAttempts = 0;
+        _nickWanted.clear();
+    }
 
-    if (SendIRC("HELLO"))
+    // Registration is held until CAP END, servers without CAP go on without
+    // it
+    if (_capWanted)
     {
-        if (!password.empty() && !SendIRC("PASS " + password))
+        if (!SendIRC("CAP LS 302"))
             return false;
-        if (SendIRC("NICK " + nick))
-            if (SendIRC("USER " + user + " 8 * :Cpp IRC Client"))
-                return true;
+        _capNegotiating = true;
     }
+    if (!password.empty() && !SendIRC("PASS ", password))
+        return false;
+    if (SendIRC("NICK ", nick))
+        if (SendIRC("USER ", user, " 8 * :Cpp IRC Client"))
+            return true;
 
     return false;
 }
 
-void IRCClient::ReceiveData()
+bool IRCClient::ChangeNick(std::string nick)
+{
+    {
+        std::lock_guard<std::mutex> lock(_nickLock);
+        _loginNick    = nick;
+        _nickAttempts = 0;
+        _nickWanted   = nick;
+    }
+    return SendIRC("NICK ", nick);
+}
+
+void IRCClient::ReceiveData(int timeout)
+{
+    int events = _socket.Wait(timeout);
+    CheckLag();
+    if (!(events & IRC_SOCKET_READABLE))
+        return;
+
+    int bytes = _socket.ReceiveData(_recvBuffer + _recvLength, IRC_RECV_BUFFER_SIZE - _recvLength);
+    if (bytes <= 0)
+        return;
+    _recvLength += bytes;
+
+    DispatchLines();
+}
+
+void IRCClient::CheckLag()
 {
-    std::string buffer = _socket.ReceiveData();
+    unsigned token;
+    if (!_registered || !_lag.Due(IRCLag::clock::now(), _pingInterval, token))
+        return;
+    if (_lag.Missed() >= _maxMissedPongs)
+    {
+        std::cout << "IRC: No PONG for " << _lag.Missed() << " PINGs, dropping connection" << std::endl;
+        Disconnect();
+        return;
+    }
+    SendIRC("PING :" IRC_LAG_TOKEN, token);
+}
 
-    std::string line;
-    std::istringstream iss(buffer);
-    while (getline(iss, line))
+void IRCClient::ProcessData(char const *data, size_t length)
+{
+    while (length)
     {
-        if (line.find("\r") != std::string::npos)
-            line = line.substr(0, line.size() - 1);
-        Parse(line);
+        size_t chunk = std::min(length, IRC_RECV_BUFFER_SIZE - _recvLength);
+        memcpy(_recvBuffer + _recvLength, data, chunk);
+        _recvLength += chunk;
+        data += chunk;
+        length -= chunk;
+
+        DispatchLines();
     }
 }
 
-void IRCClient::Parse(std::string data)
+// What a line is, as far as the chat budget is concerned
+enum IRCLineClass
 {
-    std::string original(data);
-    IRCCommandPrefix cmdPrefix;
+    // PING and PONG, answered before anything else
+    IRC_LINE_URGENT = 0,
+    // Everything but chat, and chat to a priority target
+    IRC_LINE_PRIORITY = 1,
+    IRC_LINE_CHAT     = 2,
+    // Chat over budget, dropped unparsed
+    IRC_LINE_SHED = 3
+};
 
-    // if command has prefix
-    if (data.substr(0, 1) == ":")
+static bool EqualsNoCase(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) { return toupper((unsigned char) x) == toupper((unsigned char) y); });
+}
+
+template <typename F> size_t IRCClient::ForEachLine(size_t count, F function)
+{
+    size_t start = 0, first = 0, index = 0;
+    for (size_t i = 0; i < count; ++i)
     {
-        cmdPrefix.Parse(data);
-        data = data.substr(data.find(" ") + 1);
+        size_t end = _delimiters[i];
+        if (_recvBuffer[end] != '\n')
+            continue;
+        size_t length = end - start;
+        if (length && _recvBuffer[end - 1] == '\r')
+            --length;
+        if (length)
+            function(std::string_view(_recvBuffer + start, length), first, i, start, index++);
+        start = end + 1;
+        first = i + 1;
     }
+    return start;
+}
 
-    std::string command = data.substr(0, data.find(" "));
-    std::transform(command.begin(), command.end(), command.begin(), towupper);
-    if (data.find(" ") != std::string::npos)
-        data = data.substr(data.find(" ") + 1);
+void IRCClient::DispatchLines()
+{
+    // The rest of a dropped line, up to and including its LF
+    if (_recvDiscarding)
+    {
+        char const *end = static_cast<char const *>(memchr(_recvBuffer, '\n', _recvLength));
+        if (!end)
+        {
+            _recvLength = 0;
+            return;
+        }
+        _recvDiscarding = false;
+        _recvLength -= end + 1 - _recvBuffer;
+        memmove(_recvBuffer, end + 1, _recvLength);
+    }
+
+    // One pass finds the line ends and everything the parser splits on
+    size_t count = IRCScan::Delimiters(_recvBuffer, _recvLength, _delimiters);
+    size_t start;
+    if (_chatBudget && ClassifyLines(count))
+    {
+        // Over budget: PINGs first, then the rest by priority. Order is
+        // kept within each class.
+        for (int lineClass = IRC_LINE_URGENT; lineClass <= IRC_LINE_CHAT; ++lineClass)
+            start = ForEachLine(count, [&](std::string_view line, size_t first, size_t last, size_t offset, size_t index) {
+                if (_lineClasses[index] == lineClass)
+                    ParseLine(line, _delimiters + first, last - first, offset);
+            });
+    }
     else
-        data = "";
+        start = ForEachLine(count, [&](std::string_view line, size_t first, size_t last, size_t offset, size_t) {
+            ParseLine(line, _delimiters + first, last - first, offset);
+        });
+
+    // Keep the unterminated tail for the next recv()
+    _recvLength -= start;
+    if (_recvLength && start)
+        memmove(_recvBuffer, _recvBuffer + start, _recvLength);
+    // A line that does not fit the buffer can never be completed. Dropped
+    // along with whatever of it is still to come, which would otherwise
+    // be read as a message of its own.
+    if (_recvLength == IRC_RECV_BUFFER_SIZE)
+    {
+        _recvLength     = 0;
+        _recvDiscarding = true;
+    }
 
-    std::vector<std::string> parameters;
+    _arena.Reset();
+}
 
-    if (data != "")
+int IRCClient::ClassifyLine(std::string_view data, uint16_t const *delimiters, size_t count, size_t offset)
+{
+    // Tags, prefix, command and target at most
+    std::string_view words[4];
+    size_t found = 0, from = 0;
+    for (size_t i = 0; i < count && found < 4; ++i)
     {
-        if (data.substr(0, 1) == ":")
-            parameters.push_back(data.substr(1));
-        else
+        size_t at = delimiters[i] - offset;
+        if (data[at] != ' ')
+            continue;
+        words[found++] = data.substr(from, at - from);
+        from           = at + 1;
+    }
+    if (found < 4)
+        words[found] = data.substr(from);
+
+    size_t command = 0;
+    if (words[command].size() && words[command].front() == '@')
+        ++command;
+    if (words[command].size() && words[command].front() == ':')
+        ++command;
+    if (EqualsNoCase(words[command], "PING") || EqualsNoCase(words[command], "PONG"))
+        return IRC_LINE_URGENT;
+    if (!EqualsNoCase(words[command], "PRIVMSG") && !EqualsNoCase(words[command], "NOTICE"))
+        return IRC_LINE_PRIORITY;
+    for (std::string const &target : _priorityTargets)
+        if (EqualsNoCase(words[command + 1], target))
+            return IRC_LINE_PRIORITY;
+    return IRC_LINE_CHAT;
+}
+
+bool IRCClient::ClassifyLines(size_t count)
+{
+    IRCLag::clock::time_point now = IRCLag::clock::now();
+    if (now - _tickStart >= std::chrono::milliseconds(IRC_OVERLOAD_TICK))
+    {
+        _tickStart      = now;
+        _tickChat       = 0;
+        _tickOverloaded = false;
+    }
+
+    bool shed = false;
+    std::lock_guard<std::mutex> lock(_priorityLock);
+    ForEachLine(count, [&](std::string_view line, size_t first, size_t last, size_t offset, size_t index) {
+        int lineClass = ClassifyLine(line, _delimiters + first, last - first, offset);
+        if (lineClass == IRC_LINE_CHAT && _tickChat >= _chatBudget)
         {
-            size_t pos1 = 0, pos2;
-            while ((pos2 = data.find(" ", pos1)) != std::string::npos)
+            if (!_tickOverloaded)
             {
-                parameters.push_back(data.substr(pos1, pos2 - pos1));
-                pos1 = pos2 + 1;
-                if (data.substr(pos1, 1) == ":")
-                {
-                    parameters.push_back(data.substr(pos1 + 1));
-                    break;
-                }
+                _tickOverloaded = true;
+                ++_overloads;
             }
-            if (parameters.empty())
-                parameters.push_back(data);
+            shed = true;
+            if (_chatSample && ++_sampleCount % _chatSample == 0)
+                ++_sampled;
+            else
+            {
+                lineClass = IRC_LINE_SHED;
+                ++_shed;
+            }
+        }
+        else if (lineClass == IRC_LINE_CHAT)
+            ++_tickChat;
+        _lineClasses[index] = lineClass;
+    });
+    return shed;
+}
+
+bool IRCClient::StartCapture(char const *path)
+{
+    if (!_capture.Open(path))
+        return false;
+    _socket.SetCapture(&_capture);
+    return true;
+}
+
+void IRCClient::StopCapture()
+{
+    _socket.SetCapture(NULL);
+    _capture.Close();
+}
+
+void IRCClient::Parse(std::string_view data)
+{
+    // Longer lines never make it out of the receive buffer either
+    data = data.substr(0, IRC_RECV_BUFFER_SIZE);
+    ParseLine(data, _delimiters, IRCScan::Delimiters(data.data(), data.size(), _delimiters), 0);
+    _arena.Reset();
+}
+
+void IRCClient::ParseLine(std::string_view data, uint16_t const *delimiters, size_t count, size_t offset)
+{
+    std::string_view original(data);
+    IRCMessage ircMessage(&_arena);
+    uint16_t const *delimitersEnd = delimiters + count;
+
+    // Next space at or after from, data.size() if there is none. The
+    // delimiters are walked once for the whole line.
+    auto nextSpace = [&](size_t from) {
+        for (; delimiters != delimitersEnd; ++delimiters)
+        {
+            size_t at = *delimiters - offset;
+            if (at >= from && data[at] == ' ')
+                return at;
+        }
+        return data.size();
+    };
+
+    // IRCv3 tags, only looked at past the '@' so untagged lines pay nothing
+    if (!data.empty() && data.front() == '@')
+    {
+        size_t space    = nextSpace(0);
+        ircMessage.tags = IRCTags(data.substr(1, space - 1));
+        if (delimiters != delimitersEnd)
+            ++delimiters;
+        size_t skip = std::min(space + 1, data.size());
+        data        = data.substr(skip);
+        offset += skip;
+    }
+
+    size_t pos = 0;
+    // if command has prefix
+    if (!data.empty() && data.front() == ':')
+    {
+        size_t bang = std::string_view::npos, at = std::string_view::npos, space = data.size();
+        for (; delimiters != delimitersEnd; ++delimiters)
+        {
+            size_t i = *delimiters - offset;
+            if (data[i] == ' ')
+            {
+                space = i;
+                break;
+            }
+            if (data[i] == '!' && bang == std::string_view::npos)
+                bang = i - 1;
+            else if (data[i] == '@' && at == std::string_view::npos)
+                at = i - 1;
         }
+        if (bang != std::string_view::npos && at != std::string_view::npos && bang > at)
+            bang = std::string_view::npos;
+        ircMessage.prefix.Parse(data.substr(1, space - 1), bang, at);
+        pos = std::min(space + 1, data.size());
     }
 
+    size_t space = nextSpace(pos);
+    ircMessage.command.assign(data.substr(pos, space - pos));
+    std::transform(ircMessage.command.begin(), ircMessage.command.end(), ircMessage.command.begin(), ::toupper);
+    pos = std::min(space + 1, data.size());
+
+    std::pmr::vector<std::pmr::string> &parameters = ircMessage.parameters;
+
+    while (pos < data.size())
+    {
+        if (data[pos] == ':')
+        {
+            parameters.emplace_back(data.substr(pos + 1));
+            break;
+        }
+        space = nextSpace(pos);
+        parameters.emplace_back(data.substr(pos, space - pos));
+        if (space == data.size())
+            break;
+        pos = space + 1;
+    }
+
+    std::pmr::string const &command = ircMessage.command;
+
     if (command == "ERROR")
     {
         std::cout << original << std::endl;
@@ -137,27 +411,36 @@ void IRCClient::Parse(std::string data)
     if (command == "PING")
     {
         std::cout << "Ping? Pong!" << std::endl;
-        SendIRC("PONG :" + parameters.at(0));
+        if (parameters.empty())
+            SendIRC("PONG");
+        else
+            SendIRC("PONG :", parameters.front());
         return;
     }
 
-    IRCMessage ircMessage(command, cmdPrefix, parameters);
+    // Answer to our own lag measuring PING
+    if (command == "PONG" && !parameters.empty() && _lag.Received(parameters.back(), IRCLag::clock::now()))
+        return;
 
-    // Default handler
-    int commandIndex = GetCommandHandler(command);
-    if (commandIndex < NUM_IRC_CMDS)
+    IRCEvent event = DecodeIRCEvent(ircMessage);
+    if (_capEnabled & IRC_CAP_ECHO_MESSAGE)
     {
-        IRCCommandHandler &cmdHandler = ircCommandTable[commandIndex];
-        (this->*cmdHandler.handler)(ircMessage);
+        if (IRCPrivMsgEvent *privmsg = std::get_if<IRCPrivMsgEvent>(&event))
+            privmsg->isEcho = privmsg->nick == _nick;
+        else if (IRCNoticeEvent *notice = std::get_if<IRCNoticeEvent>(&event))
+            notice->isEcho = notice->from == _nick;
     }
-    else if (_debug)
+
+    // Default handler
+    if (!HandleEvent(event) && _debug)
         std::cout << original << std::endl;
 
     // Try to call hook (if any matches)
     CallHook(command, ircMessage);
+    CallEventHooks(event, ircMessage);
 }
 
-void IRCClient::HookIRCCommand(std::string command, void *context /*ptr for whatever*/, std::function<void(IRCMessage /*message*/, IRCClient * /*client*/, void *context /*ptr for whatever*/)> function)
+void IRCClient::HookIRCCommand(std::string command, void *context /*ptr for whatever*/, IRCHookFunction function)
 {
     IRCCommandHook hook;
 
@@ -168,7 +451,17 @@ void IRCClient::HookIRCCommand(std::string command, void *context /*ptr for what
     _hooks.push_back(hook);
 }
 
-void IRCClient::CallHook(std::string command, IRCMessage message)
+void IRCClient::HookIRCEvent(void *context /*ptr for whatever*/, IRCEventFunction function)
+{
+    IRCEventHook hook;
+
+    hook.function = function;
+    hook.context  = context;
+
+    _eventHooks.push_back(hook);
+}
+
+void IRCClient::CallHook(std::string_view command, IRCMessage const &message)
 {
     if (_hooks.empty())
         return;
@@ -182,3 +475,9 @@ void IRCClient::CallHook(std::string command, IRCMessage message)
         }
     }
 }
+
+void IRCClient::CallEventHooks(IRCEvent const &event, IRCMessage const &message)
+{
+    for (std::list<IRCEventHook>::const_iterator itr = _eventHooks.begin(); itr != _eventHooks.end(); ++itr)
+        (itr->function)(event, message, this, itr->context);
+}
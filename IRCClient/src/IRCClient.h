@@ -17,61 +17,132 @@
 #define _IRCCLIENT_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <list>
+#include <atomic>
+#include <mutex>
+#include <memory_resource>
 #include "IRCSocket.h"
+#include "IRCArena.h"
+#include "IRCEvent.h"
+#include "IRCCapture.h"
+#include "IRCLag.h"
+#include "IRCFormat.h"
+#include "IRCTags.h"
 #include <functional>
 
+#define IRC_RECV_BUFFER_SIZE 8192
+// Alternate nicks tried during registration before giving up
+#define IRC_MAX_NICK_ATTEMPTS 8
+// Length of the window the chat budget applies to, in ms
+#define IRC_OVERLOAD_TICK 100
+
+// IRCv3 capabilities the client knows how to use, see SetCapabilities()
+enum IRCCapability
+{
+    // time tag on every message, see IRCTags::ServerTime()
+    IRC_CAP_SERVER_TIME = 1 << 0,
+    // Our own PRIVMSGs and NOTICEs come back once the server took them
+    IRC_CAP_ECHO_MESSAGE = 1 << 1,
+    // BATCH around related messages like netsplits
+    IRC_CAP_BATCH = 1 << 2,
+    // Tags from other clients and TAGMSG
+    IRC_CAP_MESSAGE_TAGS = 1 << 3
+};
+
 class IRCClient;
 
 extern std::vector<std::string> split(std::string const &, char);
 
+// Strings of a parsed message live in the receive batch's arena. Copying a
+// message (or taking it by value in a hook) moves it to the default heap,
+// so keep a copy if you need it after the hook returns.
 struct IRCCommandPrefix
 {
-    void Parse(std::string data)
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    IRCCommandPrefix(allocator_type alloc = {}) : prefix(alloc), nick(alloc), user(alloc), host(alloc){};
+
+    void Parse(std::string_view data)
     {
-        if (data == "")
+        if (data.empty())
             return;
 
-        prefix = data.substr(1, data.find(" ") - 1);
-        std::vector<std::string> tokens;
+        std::string_view view = data.substr(1, data.find(' ') - 1);
+        size_t at             = view.find('@');
+        Parse(view, view.substr(0, at).find('!'), at);
+    };
 
-        if (prefix.find("@") != std::string::npos)
-        {
-            tokens = split(prefix, '@');
-            nick   = tokens.at(0);
-            host   = tokens.at(1);
-        }
-        if (nick != "" && nick.find("!") != std::string::npos)
+    // view is the prefix without ':', bang the first '!' before the first
+    // '@' at, either npos if missing
+    void Parse(std::string_view view, size_t bang, size_t at)
+    {
+        prefix.assign(view);
+        if (at == std::string_view::npos)
+            return;
+        host.assign(view.substr(at + 1));
+        view = view.substr(0, at);
+
+        if (bang == std::string_view::npos)
         {
-            tokens = split(nick, '!');
-            nick   = tokens.at(0);
-            user   = tokens.at(1);
+            nick.assign(view);
+            return;
         }
+        nick.assign(view.substr(0, bang));
+        user.assign(view.substr(bang + 1));
     };
 
-    std::string prefix;
-    std::string nick;
-    std::string user;
-    std::string host;
+    std::pmr::string prefix;
+    std::pmr::string nick;
+    std::pmr::string user;
+    std::pmr::string host;
 };
 
 struct IRCMessage
 {
-    IRCMessage();
-    IRCMessage(std::string cmd, IRCCommandPrefix p, std::vector<std::string> params) : command(cmd), prefix(p), parameters(params){};
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
 
-    std::string command;
+    IRCMessage(allocator_type alloc = {}) : command(alloc), prefix(alloc), parameters(alloc){};
+
+    // Point into the received line, a copy of the message does not own them
+    IRCTags tags;
+    std::pmr::string command;
     IRCCommandPrefix prefix;
-    std::vector<std::string> parameters;
+    std::pmr::vector<std::pmr::string> parameters;
 };
 
+typedef std::function<void(IRCMessage const & /*message*/, IRCClient * /*client*/, void *context)> IRCHookFunction;
+
 struct IRCCommandHook
 {
     IRCCommandHook() : function(NULL){};
 
     std::string command;
-    std::function<void(IRCMessage /*message*/, IRCClient * /*client*/, void *context)> function;
+    IRCHookFunction function;
+    // A ptr that can be used for whatever
+    void *context;
+};
+
+typedef std::function<void(IRCEvent const & /*event*/, IRCMessage const & /*message*/, IRCClient * /*client*/, void *context)> IRCEventFunction;
+
+// Returns the nick to try after attempt alternates of nick were taken
+typedef std::function<std::string(std::string const & /*nick*/, unsigned /*attempt*/)> IRCNickFunction;
+
+// Chat the receive side left out once over budget, see SetChatBudget()
+struct IRCOverloadStats
+{
+    // Ticks in which the chat budget ran out
+    uint64_t ticks;
+    // Chat lines dropped without being parsed
+    uint64_t shed;
+    // Chat lines over budget that were parsed anyway
+    uint64_t sampled;
+};
+
+struct IRCEventHook
+{
+    IRCEventFunction function;
     // A ptr that can be used for whatever
     void *context;
 };
@@ -79,37 +150,155 @@ struct IRCCommandHook
 class IRCClient
 {
 public:
-    IRCClient() : _debug(false){};
+    IRCClient() : _recvLength(0), _recvDiscarding(false), _chatBudget(0), _chatSample(0), _tickChat(0), _tickOverloaded(false), _sampleCount(0), _overloads(0), _shed(0), _sampled(0), _pingInterval(IRC_PING_INTERVAL), _maxMissedPongs(IRC_MAX_MISSED_PONGS), _registered(false), _capWanted(IRC_CAP_SERVER_TIME | IRC_CAP_BATCH), _capOffered(0), _capEnabled(0), _capNegotiating(false), _nickAttempts(0), _debug(false){};
 
     bool InitSocket();
     bool Connect(const char * /*host*/, int /*port*/);
     void Disconnect();
+    // Sends QUIT and waits up to timeout ms for everything queued to be
+    // written before disconnecting
+    void Quit(std::string /*message*/, int timeout);
+    // Makes a ReceiveData() or Connect() blocked in another thread return
+    void Interrupt()
+    {
+        _socket.Wake();
+    };
     bool Connected()
     {
         return _socket.Connected();
     };
 
-    bool SendIRC(std::string /*data*/);
+    // Takes effect on the next InitSocket(), see IRCSocketBackend
+    bool SetSocketBackend(IRCSocketBackend backend)
+    {
+        return _socket.SetBackend(backend);
+    };
+    IRCSocketBackend GetSocketBackend()
+    {
+        return _socket.Backend();
+    };
+    // Socket related system calls made so far
+    uint64_t GetSocketSyscalls()
+    {
+        return _socket.Syscalls();
+    };
+    // Bytes sent but not yet written to the socket
+    size_t GetSendQueued()
+    {
+        return _socket.Queued();
+    };
+
+    // Queues one line made of the given pieces, see IRCFormat.h. The line is
+    // formatted on the stack and handed to the socket in a single write,
+    // false if it is too long or a piece contains a line break.
+    template <typename... Args> bool SendIRC(Args const &...args)
+    {
+        char line[IRC_MAX_LINE];
+        size_t length = IRCFormat::Line(line, sizeof(line), args...);
+        return length && _socket.SendData(line, length);
+    };
 
     bool Login(std::string /*nick*/, std::string /*user*/, std::string /*password*/ = std::string());
+    // Changes our nick once registered. If it is in use the alternates are
+    // tried like during registration, GetNick() follows once the server
+    // accepted one. May be called from any thread.
+    bool ChangeNick(std::string /*nick*/);
+    // Picks the alternates tried when the server says our nick is in use
+    // during registration or ChangeNick(). By default attempt n appends _n
+    // to the nick.
+    void SetAlternateNick(IRCNickFunction function)
+    {
+        _alternateNick = function;
+    };
+    // IRCCapability bits requested during the next registration, those the
+    // server does not offer are left out. server-time and batch by default.
+    void SetCapabilities(unsigned capabilities)
+    {
+        _capWanted = capabilities;
+    };
+    // IRCCapability bits the server enabled, may be called from any thread
+    unsigned GetCapabilities()
+    {
+        return _capEnabled;
+    };
+    // The nick the server knows us by, the one given to Login() until it
+    // accepted or changed it. Only safe to call from the receiving thread.
+    std::string const &GetNick()
+    {
+        return _nick;
+    };
 
-    void ReceiveData();
+    // Waits up to timeout ms for data and dispatches it
+    void ReceiveData(int timeout = IRC_POLL_TIMEOUT);
+    // Frames and dispatches raw bytes as if they came from the socket
+    void ProcessData(char const * /*data*/, size_t /*length*/);
 
-    void HookIRCCommand(std::string command, void *context /*ptr for whatever*/, std::function<void(IRCMessage /*message*/, IRCClient * /*client*/, void *context /*ptr for whatever*/)> function);
+    // Appends all traffic of this client to a capture file, see IRCCapture.h
+    bool StartCapture(char const * /*path*/);
+    void StopCapture();
 
-    void Parse(std::string /*data*/);
+    void HookIRCCommand(std::string command, void *context /*ptr for whatever*/, IRCHookFunction function);
+    // Called for every message with its typed event, see IRCEvent.h
+    void HookIRCEvent(void *context /*ptr for whatever*/, IRCEventFunction function);
+
+    // Parses a single line and releases its transient memory afterwards
+    void Parse(std::string_view /*data*/);
+
+    // Memory of the receive batch currently being dispatched. Handlers may
+    // allocate scratch data from it, it is released once the batch is done.
+    std::pmr::memory_resource *GetArena()
+    {
+        return &_arena;
+    };
 
-    void HandleCTCP(IRCMessage /*message*/);
+    void HandleCTCP(IRCPrivMsgEvent const & /*event*/);
 
     // Default internal handlers
-    void HandlePrivMsg(IRCMessage /*message*/);
-    void HandleNotice(IRCMessage /*message*/);
-    void HandleChannelJoinPart(IRCMessage /*message*/);
-    void HandleUserNickChange(IRCMessage /*message*/);
-    void HandleUserQuit(IRCMessage /*message*/);
-    void HandleChannelNamesList(IRCMessage /*message*/);
-    void HandleNicknameInUse(IRCMessage /*message*/);
-    void HandleServerMessage(IRCMessage /*message*/);
+    void HandlePrivMsg(IRCPrivMsgEvent const & /*event*/);
+    void HandleNotice(IRCNoticeEvent const & /*event*/);
+    void HandleChannelJoin(IRCJoinEvent const & /*event*/);
+    void HandleChannelPart(IRCPartEvent const & /*event*/);
+    void HandleUserNickChange(IRCNickEvent const & /*event*/);
+    void HandleUserQuit(IRCQuitEvent const & /*event*/);
+    void HandleChannelNamesList(IRCNamesEvent const & /*event*/);
+    void HandleNicknameInUse(IRCNumericEvent const & /*event*/);
+    void HandleCapability(IRCCapEvent const & /*event*/);
+    void HandleServerMessage(IRCNumericEvent const & /*event*/);
+
+    // We PING the server every interval ms and drop the connection after
+    // maxMissed PINGs in a row went unanswered
+    void SetPingInterval(int interval, unsigned maxMissed)
+    {
+        _pingInterval   = interval;
+        _maxMissedPongs = maxMissed;
+    };
+    IRCLagStats GetLag()
+    {
+        return _lag.Stats();
+    };
+
+    // Parses at most lines chat lines (PRIVMSG and NOTICE) every
+    // IRC_OVERLOAD_TICK ms. Once a receive batch goes over, its PINGs are
+    // answered first, then everything but chat is handled and of the chat
+    // only every sample-th line is kept, 0 drops all of it. Lines are sorted
+    // out from the scanner's offsets before they are parsed. 0 lines, the
+    // default, handles everything in order. Call before connecting.
+    void SetChatBudget(unsigned lines, unsigned sample)
+    {
+        _chatBudget = lines;
+        _chatSample = sample;
+    };
+    // Chat to these targets, e.g. a control channel, is never shed. May be
+    // called from any thread.
+    void SetPriorityTargets(std::vector<std::string> targets)
+    {
+        std::lock_guard<std::mutex> lock(_priorityLock);
+        _priorityTargets = std::move(targets);
+    };
+    IRCOverloadStats GetOverloadStats()
+    {
+        return {_overloads.load(), _shed.load(), _sampled.load()};
+    };
 
     void Debug(bool debug)
     {
@@ -117,15 +306,79 @@ public:
     };
 
 private:
-    void HandleCommand(IRCMessage /*message*/);
-    void CallHook(std::string /*command*/, IRCMessage /*message*/);
+    // delimiters are the scanner's offsets for the line, relative to the
+    // buffer it starts at offset of
+    void ParseLine(std::string_view /*data*/, uint16_t const * /*delimiters*/, size_t /*count*/, size_t /*offset*/);
+    void DispatchLines();
+    // Calls function(line, first, last, offset, index) for every complete
+    // line in _recvBuffer, first and last bound its delimiters. Returns where
+    // the unterminated tail starts.
+    template <typename F> size_t ForEachLine(size_t /*count*/, F /*function*/);
+    // One of IRCLineClass, from the first three words of a line
+    int ClassifyLine(std::string_view /*data*/, uint16_t const * /*delimiters*/, size_t /*count*/, size_t /*offset*/);
+    // Fills _lineClasses and decides which chat to shed, true if any was
+    bool ClassifyLines(size_t /*count*/);
+    void CheckLag();
+    void EndCapabilities();
+    bool HandleEvent(IRCEvent const & /*event*/);
+    void CallHook(std::string_view /*command*/, IRCMessage const & /*message*/);
+    void CallEventHooks(IRCEvent const & /*event*/, IRCMessage const & /*message*/);
 
     IRCSocket _socket;
 
+    // Backs every message parsed out of one receive batch
+    IRCArena _arena;
+    // Raw bytes from the socket, a partial line is kept at the front
+    char _recvBuffer[IRC_RECV_BUFFER_SIZE];
+    size_t _recvLength;
+    // Skipping input up to the next LF, the start of its line was dropped
+    bool _recvDiscarding;
+    // Offsets of the delimiters in _recvBuffer, see IRCScan.h
+    uint16_t _delimiters[IRC_RECV_BUFFER_SIZE];
+    // Class of every line in _recvBuffer while over the chat budget
+    uint8_t _lineClasses[IRC_RECV_BUFFER_SIZE];
+
+    unsigned _chatBudget;
+    unsigned _chatSample;
+    std::vector<std::string> _priorityTargets;
+    std::mutex _priorityLock;
+    IRCLag::clock::time_point _tickStart;
+    // Chat lines parsed in the current tick
+    unsigned _tickChat;
+    bool _tickOverloaded;
+    unsigned _sampleCount;
+    std::atomic<uint64_t> _overloads;
+    std::atomic<uint64_t> _shed;
+    std::atomic<uint64_t> _sampled;
+
+    IRCCapture _capture;
+
+    IRCLag _lag;
+    int _pingInterval;
+    unsigned _maxMissedPongs;
+    // Set once the server sent RPL_WELCOME
+    bool _registered;
+
+    unsigned _capWanted;
+    // Offered by the CAP LS lines seen so far
+    unsigned _capOffered;
+    std::atomic<unsigned> _capEnabled;
+    // Registration waits for our CAP END
+    bool _capNegotiating;
+
     std::list<IRCCommandHook> _hooks;
+    std::list<IRCEventHook> _eventHooks;
 
     std::string _nick;
     std::string _user;
+    // Nick given to Login() or ChangeNick() and how many alternates of it
+    // were tried. Once registered _nickWanted is the one we asked for and
+    // the server did not accept yet.
+    std::string _loginNick;
+    std::string _nickWanted;
+    unsigned _nickAttempts;
+    std::mutex _nickLock;
+    IRCNickFunction _alternateNick;
 
     bool _debug;
 };
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "IRCEvent.h"
+#include "IRCClient.h"
+
+static bool IsCtcp(std::string_view &text)
+{
+    if (text.size() < 2 || text.front() != '\001')
+        return false;
+    text.remove_prefix(1);
+    if (text.back() == '\001')
+        text.remove_suffix(1);
+    return true;
+}
+
+static bool IsNumeric(std::string_view command)
+{
+    return command.size() == 3 && command[0] >= '0' && command[0] <= '9' && command[1] >= '0' && command[1] <= '9' && command[2] >= '0' && command[2] <= '9';
+}
+
+IRCEvent DecodeIRCEvent(IRCMessage const &message)
+{
+    std::string_view command                     = message.command;
+    std::pmr::vector<std::pmr::string> const &params = message.parameters;
+    size_t count                                 = params.size();
+
+    if (IsNumeric(command))
+    {
+        IRCNumericEvent event;
+        event.code    = (command[0] - '0') * 100 + (command[1] - '0') * 10 + (command[2] - '0');
+        event.target  = count ? std::string_view(params.front()) : std::string_view();
+        event.text    = count ? std::string_view(params.back()) : std::string_view();
+        event.message = &message;
+        if (event.code == 353)
+        {
+            if (count < 4)
+                return std::monostate();
+            return IRCNamesEvent{ params[2], params[3] };
+        }
+        return event;
+    }
+
+    if (command == "PRIVMSG")
+    {
+        if (count < 2 || params.front().empty())
+            return std::monostate();
+        IRCPrivMsgEvent event{ message.prefix.nick, params.front(), params.back(), false, false };
+        event.isCtcp = IsCtcp(event.text);
+        return event;
+    }
+    if (command == "NOTICE")
+    {
+        if (count < 1)
+            return std::monostate();
+        std::string_view from = !message.prefix.nick.empty() ? message.prefix.nick : message.prefix.prefix;
+        IRCNoticeEvent event{ from, count > 1 ? std::string_view(params.front()) : std::string_view(), params.back(), false, false };
+        event.isCtcp = IsCtcp(event.text);
+        return event;
+    }
+    if (command == "JOIN")
+    {
+        if (count < 1)
+            return std::monostate();
+        return IRCJoinEvent{ message.prefix.nick, params.front() };
+    }
+    if (command == "PART")
+    {
+        if (count < 1)
+            return std::monostate();
+        return IRCPartEvent{ message.prefix.nick, params.front(), count > 1 ? std::string_view(params.back()) : std::string_view() };
+    }
+    if (command == "QUIT")
+        return IRCQuitEvent{ message.prefix.nick, count ? std::string_view(params.front()) : std::string_view() };
+    if (command == "NICK")
+    {
+        if (count < 1)
+            return std::monostate();
+        return IRCNickEvent{ message.prefix.nick, params.front() };
+    }
+    if (command == "CAP")
+    {
+        // CAP <target> <subcommand> [*] :<capabilities>
+        if (count < 2)
+            return std::monostate();
+        bool more = count > 3 && params[2] == "*";
+        return IRCCapEvent{ params[1], count > 2 ? std::string_view(params.back()) : std::string_view(), more };
+    }
+    if (command == "BATCH")
+    {
+        // BATCH +<reference> <type> [parameters...] or BATCH -<reference>
+        if (count < 1 || params.front().size() < 2 || (params.front()[0] != '+' && params.front()[0] != '-'))
+            return std::monostate();
+        bool start = params.front()[0] == '+';
+        if (start && count < 2)
+            return std::monostate();
+        return IRCBatchEvent{ start, std::string_view(params.front()).substr(1), start ? std::string_view(params[1]) : std::string_view(), &message };
+    }
+
+    return std::monostate();
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCEVENT_H
+#define _IRCEVENT_H
+
+#include <string_view>
+#include <variant>
+
+struct IRCMessage;
+
+// Typed views of the messages the client understands. They are validated
+// once when decoded and point into the IRCMessage they were decoded from,
+// so they are only valid while that message is being dispatched.
+
+struct IRCPrivMsgEvent
+{
+    std::string_view nick;
+    std::string_view target;
+    // For CTCP requests the surrounding '\001' are stripped
+    std::string_view text;
+    bool isCtcp;
+    // Our own message handed back by the server, with echo-message
+    bool isEcho;
+};
+
+struct IRCNoticeEvent
+{
+    // Nick of the sender or the server name
+    std::string_view from;
+    std::string_view target;
+    std::string_view text;
+    bool isCtcp;
+    bool isEcho;
+};
+
+struct IRCJoinEvent
+{
+    std::string_view nick;
+    std::string_view channel;
+};
+
+struct IRCPartEvent
+{
+    std::string_view nick;
+    std::string_view channel;
+    std::string_view reason;
+};
+
+struct IRCQuitEvent
+{
+    std::string_view nick;
+    std::string_view reason;
+};
+
+struct IRCNickEvent
+{
+    std::string_view nick;
+    std::string_view newNick;
+};
+
+// RPL_NAMREPLY (353)
+struct IRCNamesEvent
+{
+    std::string_view channel;
+    // Space separated, may carry channel mode prefixes like '@'
+    std::string_view names;
+};
+
+// CAP replies while negotiating IRCv3 capabilities
+struct IRCCapEvent
+{
+    // LS, ACK, NAK, NEW or DEL
+    std::string_view subcommand;
+    // Space separated, LS may give values as name=value and ACK may prefix
+    // a name with '-' for a disabled capability
+    std::string_view capabilities;
+    // More lines of the same reply follow
+    bool more;
+};
+
+// Start or end of a batch, messages in it carry its reference in their
+// batch tag
+struct IRCBatchEvent
+{
+    bool start;
+    std::string_view reference;
+    // Only set on the start, e.g. netsplit or chathistory
+    std::string_view type;
+    IRCMessage const *message;
+};
+
+struct IRCNumericEvent
+{
+    int code;
+    // First parameter, usually our own nick
+    std::string_view target;
+    // Last parameter
+    std::string_view text;
+    IRCMessage const *message;
+};
+
+// std::monostate means the message is of a type without a typed event or
+// failed validation; it is still delivered through the IRCMessage hooks.
+typedef std::variant<std::monostate, IRCPrivMsgEvent, IRCNoticeEvent, IRCJoinEvent, IRCPartEvent, IRCQuitEvent, IRCNickEvent, IRCNamesEvent, IRCCapEvent, IRCBatchEvent, IRCNumericEvent> IRCEvent;
+
+IRCEvent DecodeIRCEvent(IRCMessage const & /*message*/);
+
+// Builds a visitor out of lambdas, std::visit(IRCOverloaded{ ... }, event)
+template <class... Ts> struct IRCOverloaded : Ts...
+{
+    using Ts::operator()...;
+};
+template <class... Ts> IRCOverloaded(Ts...)->IRCOverloaded<Ts...>;
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCFORMAT_H
+#define _IRCFORMAT_H
+
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+// Longest line the server accepts, CRLF included
+#define IRC_MAX_LINE 512
+
+// Formats outbound lines from pieces without building temporaries. A piece
+// is a string literal, anything convertible to std::string_view, a char or
+// an integer. Literal lengths are known at compile time, integers reserve
+// their widest representation while checking and use their real length.
+namespace IRCFormat
+{
+template <typename T> struct Piece
+{
+    static_assert(std::is_integral<T>::value, "IRCFormat: unsupported piece type");
+
+    static constexpr size_t MaxLength()
+    {
+        return std::numeric_limits<T>::digits10 + 2;
+    }
+    static size_t Length(T)
+    {
+        return MaxLength();
+    }
+    static bool Clean(T)
+    {
+        return true;
+    }
+    static char *Write(char *out, T value)
+    {
+        return std::to_chars(out, out + MaxLength(), value).ptr;
+    }
+};
+
+template <> struct Piece<bool> : Piece<int>
+{
+};
+
+template <> struct Piece<char>
+{
+    static size_t Length(char)
+    {
+        return 1;
+    }
+    static bool Clean(char c)
+    {
+        return c != '\r' && c != '\n';
+    }
+    static char *Write(char *out, char c)
+    {
+        *out = c;
+        return out + 1;
+    }
+};
+
+struct StringPiece
+{
+    static size_t Length(std::string_view s)
+    {
+        return s.size();
+    }
+    // A CR or LF would end the line early and let the rest pass as a command
+    static bool Clean(std::string_view s)
+    {
+        return s.find_first_of("\r\n") == std::string_view::npos;
+    }
+    static char *Write(char *out, std::string_view s)
+    {
+        memcpy(out, s.data(), s.size());
+        return out + s.size();
+    }
+};
+
+template <size_t N> struct Piece<char[N]> : StringPiece
+{
+    static constexpr size_t Length(char const (&)[N])
+    {
+        return N - 1;
+    }
+    static char *Write(char *out, char const (&s)[N])
+    {
+        memcpy(out, s, N - 1);
+        return out + N - 1;
+    }
+};
+
+template <typename T> using PieceOf = typename std::conditional<std::is_convertible<T const &, std::string_view>::value && !std::is_array<T>::value, StringPiece, Piece<T>>::type;
+
+template <typename... Args> size_t Length(Args const &...args)
+{
+    return (size_t(0) + ... + PieceOf<Args>::Length(args));
+}
+
+template <typename... Args> bool Clean(Args const &...args)
+{
+    return (true && ... && PieceOf<Args>::Clean(args));
+}
+
+// Writes the pieces to out and returns the length, 0 if they do not fit in
+// capacity bytes
+template <typename... Args> size_t Write(char *out, size_t capacity, Args const &...args)
+{
+    if (Length(args...) > capacity)
+        return 0;
+    char *end = out;
+    ((end = PieceOf<Args>::Write(end, args)), ...);
+    return end - out;
+}
+
+// Like Write() but terminates the line with CRLF. Fails for lines longer
+// than IRC_MAX_LINE and for pieces containing a line break.
+template <typename... Args> size_t Line(char *out, size_t capacity, Args const &...args)
+{
+    if (capacity > IRC_MAX_LINE)
+        capacity = IRC_MAX_LINE;
+    if (capacity < 2 || !Clean(args...))
+        return 0;
+    size_t length = Write(out, capacity - 2, args...);
+    if (!length)
+        return 0;
+    out[length]     = '\r';
+    out[length + 1] = '\n';
+    return length + 2;
+}
+} // namespace IRCFormat
+
+#endif
@@ -15,113 +15,297 @@
 
 #include "IRCHandler.h"
 
-IRCCommandHandler ircCommandTable[NUM_IRC_CMDS] = {
-    { "PRIVMSG", &IRCClient::HandlePrivMsg }, { "NOTICE", &IRCClient::HandleNotice }, { "JOIN", &IRCClient::HandleChannelJoinPart }, { "PART", &IRCClient::HandleChannelJoinPart }, { "NICK", &IRCClient::HandleUserNickChange }, { "QUIT", &IRCClient::HandleUserQuit }, { "353", &IRCClient::HandleChannelNamesList }, { "433", &IRCClient::HandleNicknameInUse }, { "001", &IRCClient::HandleServerMessage }, { "002", &IRCClient::HandleServerMessage }, { "003", &IRCClient::HandleServerMessage }, { "004", &IRCClient::HandleServerMessage }, { "005", &IRCClient::HandleServerMessage }, { "250", &IRCClient::HandleServerMessage }, { "251", &IRCClient::HandleServerMessage }, { "252", &IRCClient::HandleServerMessage }, { "253", &IRCClient::HandleServerMessage }, { "254", &IRCClient::HandleServerMessage }, { "255", &IRCClient::HandleServerMessage }, { "265", &IRCClient::HandleServerMessage }, { "266", &IRCClient::HandleServerMessage }, { "366", &IRCClient::HandleServerMessage }, { "372", &IRCClient::HandleServerMessage }, { "375", &IRCClient::HandleServerMessage }, { "376", &IRCClient::HandleServerMessage }, { "439", &IRCClient::HandleServerMessage },
+int const serverNumericTable[NUM_SERVER_NUMERICS] = {
+    1, 2, 3, 4, 5, 250, 251, 252, 253, 254, 255, 265, 266, 366, 372, 375, 376, 439,
 };
 
-void IRCClient::HandleCTCP(IRCMessage message)
+static struct
 {
-    std::string to   = message.parameters.at(0);
-    std::string text = message.parameters.at(message.parameters.size() - 1);
+    IRCCapability capability;
+    std::string_view name;
+} const capabilityTable[] = {
+    { IRC_CAP_SERVER_TIME, "server-time" },
+    { IRC_CAP_ECHO_MESSAGE, "echo-message" },
+    { IRC_CAP_BATCH, "batch" },
+    { IRC_CAP_MESSAGE_TAGS, "message-tags" },
+};
 
-    // Remove '\001' from start/end of the string
-    text = text.substr(1, text.size() - 2);
+// IRCCapability bits of the names in a CAP reply, values and '-' dropped
+static unsigned CapabilityBits(std::string_view names, bool disabled)
+{
+    unsigned capabilities = 0;
+    while (!names.empty())
+    {
+        size_t end            = names.find(' ');
+        std::string_view name = names.substr(0, end);
+        names.remove_prefix(end == std::string_view::npos ? names.size() : end + 1);
+        if (name.empty() || (name.front() == '-') != disabled)
+            continue;
+        if (disabled)
+            name.remove_prefix(1);
+        name = name.substr(0, name.find('='));
+        for (auto const &entry : capabilityTable)
+            if (entry.name == name)
+                capabilities |= entry.capability;
+    }
+    return capabilities;
+}
+
+bool IRCClient::HandleEvent(IRCEvent const &event)
+{
+    return std::visit(IRCOverloaded{
+                          [](std::monostate) { return false; },
+                          [this](IRCPrivMsgEvent const &e) {
+                              HandlePrivMsg(e);
+                              return true;
+                          },
+                          [this](IRCNoticeEvent const &e) {
+                              HandleNotice(e);
+                              return true;
+                          },
+                          [this](IRCJoinEvent const &e) {
+                              HandleChannelJoin(e);
+                              return true;
+                          },
+                          [this](IRCPartEvent const &e) {
+                              HandleChannelPart(e);
+                              return true;
+                          },
+                          [this](IRCQuitEvent const &e) {
+                              HandleUserQuit(e);
+                              return true;
+                          },
+                          [this](IRCNickEvent const &e) {
+                              if (e.nick == _nick)
+                              {
+                                  _nick = e.newNick;
+                                  std::lock_guard<std::mutex> lock(_nickLock);
+                                  _nickWanted.clear();
+                              }
+                              HandleUserNickChange(e);
+                              return true;
+                          },
+                          [this](IRCNamesEvent const &e) {
+                              HandleChannelNamesList(e);
+                              return true;
+                          },
+                          [this](IRCCapEvent const &e) {
+                              HandleCapability(e);
+                              return true;
+                          },
+                          // Left to hooks, which can tell the messages of a
+                          // batch by their batch tag
+                          [](IRCBatchEvent const &) { return true; },
+                          [this](IRCNumericEvent const &e) {
+                              // The server may have shortened our nick,
+                              // RPL_WELCOME is addressed to the real one
+                              if (e.code == 1)
+                              {
+                                  _registered = true;
+                                  // Servers without CAP never answer it
+                                  _capNegotiating = false;
+                                  if (!e.target.empty())
+                                      _nick = e.target;
+                              }
+                              if (e.code == 433)
+                                  HandleNicknameInUse(e);
+                              else if (IsServerNumeric(e.code))
+                                  HandleServerMessage(e);
+                              else
+                                  return false;
+                              return true;
+                          },
+                      },
+                      event);
+}
 
-    std::cout << "[" + message.prefix.nick << " requested CTCP " << text << "]" << std::endl;
+void IRCClient::HandleCTCP(IRCPrivMsgEvent const &event)
+{
+    std::cout << "[" << event.nick << " requested CTCP " << event.text << "]" << std::endl;
 
-    if (to == _nick)
+    if (event.target == _nick)
     {
-        if (text == "VERSION") // Respond to CTCP VERSION
+        if (event.text == "VERSION") // Respond to CTCP VERSION
         {
-            SendIRC("NOTICE " + message.prefix.nick + " :\001VERSION Open source IRC client by Fredi Machado - https://github.com/fredimachado/IRCClient \001");
+            SendIRC("NOTICE ", event.nick, " :\001VERSION Open source IRC client by Fredi Machado - https://github.com/fredimachado/IRCClient \001");
             return;
         }
 
         // CTCP not implemented
-        SendIRC("NOTICE " + message.prefix.nick + " :\001ERRMSG " + text + " :Not implemented\001");
+        SendIRC("NOTICE ", event.nick, " :\001ERRMSG ", event.text, " :Not implemented\001");
     }
 }
 
-void IRCClient::HandlePrivMsg(IRCMessage message)
+void IRCClient::HandlePrivMsg(IRCPrivMsgEvent const &event)
 {
-    std::string to   = message.parameters.at(0);
-    std::string text = message.parameters.at(message.parameters.size() - 1);
-
     // Handle Client-To-Client Protocol
-    if (text[0] == '\001')
+    if (event.isCtcp)
     {
-        HandleCTCP(message);
+        HandleCTCP(event);
         return;
     }
 
-    if (to[0] == '#')
-        std::cout << "From " + message.prefix.nick << " @ " + to + ": " << text << std::endl;
+    if (event.target[0] == '#')
+        std::cout << "From " << event.nick << " @ " << event.target << ": " << event.text << std::endl;
     else
-        std::cout << "From " + message.prefix.nick << ": " << text << std::endl;
+        std::cout << "From " << event.nick << ": " << event.text << std::endl;
 }
 
-void IRCClient::HandleNotice(IRCMessage message)
+void IRCClient::HandleNotice(IRCNoticeEvent const &event)
 {
-    std::string from = message.prefix.nick != "" ? message.prefix.nick : message.prefix.prefix;
-    std::string text;
-
-    if (!message.parameters.empty())
-        text = message.parameters.at(message.parameters.size() - 1);
+    std::string_view text = event.text;
 
-    if (!text.empty() && text[0] == '\001')
+    if (event.isCtcp)
     {
-        text = text.substr(1, text.size() - 2);
-        if (text.find(" ") == std::string::npos)
+        size_t space = text.find(' ');
+        if (space == std::string_view::npos)
         {
-            std::cout << "[Invalid " << text << " reply from " << from << "]" << std::endl;
+            std::cout << "[Invalid " << text << " reply from " << event.from << "]" << std::endl;
             return;
         }
-        std::string ctcp = text.substr(0, text.find(" "));
-        std::cout << "[" << from << " " << ctcp << " reply]: " << text.substr(text.find(" ") + 1) << std::endl;
+        std::cout << "[" << event.from << " " << text.substr(0, space) << " reply]: " << text.substr(space + 1) << std::endl;
     }
     else
-        std::cout << "-" << from << "- " << text << std::endl;
+        std::cout << "-" << event.from << "- " << text << std::endl;
+}
+
+void IRCClient::HandleChannelJoin(IRCJoinEvent const &event)
+{
+    std::cout << event.nick << " joins " << event.channel << std::endl;
 }
 
-void IRCClient::HandleChannelJoinPart(IRCMessage message)
+void IRCClient::HandleChannelPart(IRCPartEvent const &event)
 {
-    std::string channel = message.parameters.at(0);
-    std::string action  = message.command == "JOIN" ? "joins" : "leaves";
-    std::cout << message.prefix.nick << " " << action << " " << channel << std::endl;
+    std::cout << event.nick << " leaves " << event.channel << std::endl;
 }
 
-void IRCClient::HandleUserNickChange(IRCMessage message)
+void IRCClient::HandleUserNickChange(IRCNickEvent const &event)
 {
-    std::string newNick = message.parameters.at(0);
-    std::cout << message.prefix.nick << " changed his nick to " << newNick << std::endl;
+    std::cout << event.nick << " changed his nick to " << event.newNick << std::endl;
 }
 
-void IRCClient::HandleUserQuit(IRCMessage message)
+void IRCClient::HandleUserQuit(IRCQuitEvent const &event)
 {
-    std::string text = message.parameters.at(0);
-    std::cout << message.prefix.nick << " quits (" << text << ")" << std::endl;
+    std::cout << event.nick << " quits (" << event.reason << ")" << std::endl;
+}
+
+void IRCClient::HandleChannelNamesList(IRCNamesEvent const &event)
+{
+    std::cout << "People on " << event.channel << ":" << std::endl << event.names << std::endl;
+}
+
+void IRCClient::HandleNicknameInUse(IRCNumericEvent const &event)
+{
+    std::pmr::vector<std::pmr::string> const &params = event.message->parameters;
+    if (params.size() >= 3)
+        std::cout << params[1] << " " << params[2] << std::endl;
+    else
+        std::cout << event.text << std::endl;
+
+    // Registration or a ChangeNick() is still waiting for a nick, try the
+    // next alternate on this connection instead of giving up
+    std::string nick;
+    unsigned attempt;
+    {
+        std::lock_guard<std::mutex> lock(_nickLock);
+        if (_loginNick.empty() || (_registered && _nickWanted.empty()))
+            return;
+        if (_nickAttempts == IRC_MAX_NICK_ATTEMPTS)
+        {
+            std::cout << "No alternate for nick " << _loginNick << " was free" << std::endl;
+            _nickWanted.clear();
+            return;
+        }
+        nick    = _loginNick;
+        attempt = ++_nickAttempts;
+    }
+    // Called without the lock, the function may take locks of its own
+    if (_alternateNick)
+        nick = _alternateNick(nick, attempt);
+    else
+        nick += '_' + std::to_string(attempt);
+    // Until registered the server knows us by whatever we asked for last
+    if (_registered)
+    {
+        std::lock_guard<std::mutex> lock(_nickLock);
+        _nickWanted = nick;
+    }
+    else
+        _nick = nick;
+    SendIRC("NICK ", nick);
 }
 
-void IRCClient::HandleChannelNamesList(IRCMessage message)
+void IRCClient::HandleCapability(IRCCapEvent const &event)
 {
-    std::string channel = message.parameters.at(2);
-    std::string nicks   = message.parameters.at(3);
-    std::cout << "People on " << channel << ":" << std::endl << nicks << std::endl;
+    unsigned request = 0;
+    if (event.subcommand == "LS")
+    {
+        _capOffered |= CapabilityBits(event.capabilities, false);
+        if (event.more)
+            return;
+        request = _capWanted & _capOffered;
+        if (!request)
+        {
+            EndCapabilities();
+            return;
+        }
+    }
+    else if (event.subcommand == "ACK")
+    {
+        _capEnabled = (_capEnabled | CapabilityBits(event.capabilities, false)) & ~CapabilityBits(event.capabilities, true);
+        if (!event.more)
+            EndCapabilities();
+        return;
+    }
+    else if (event.subcommand == "NAK")
+    {
+        std::cout << "Server refused capabilities " << event.capabilities << std::endl;
+        EndCapabilities();
+        return;
+    }
+    else if (event.subcommand == "DEL")
+    {
+        _capEnabled &= ~CapabilityBits(event.capabilities, false);
+        return;
+    }
+    else if (event.subcommand == "NEW")
+    {
+        request = _capWanted & CapabilityBits(event.capabilities, false) & ~_capEnabled;
+        if (!request)
+            return;
+    }
+    else
+        return;
+
+    std::string names;
+    for (auto const &entry : capabilityTable)
+    {
+        if (!(request & entry.capability))
+            continue;
+        if (!names.empty())
+            names += ' ';
+        names += entry.name;
+    }
+    SendIRC("CAP REQ :", names);
 }
 
-void IRCClient::HandleNicknameInUse(IRCMessage message)
+void IRCClient::EndCapabilities()
 {
-    std::cout << message.parameters.at(1) << " " << message.parameters.at(2) << std::endl;
+    if (!_capNegotiating)
+        return;
+    _capNegotiating = false;
+    SendIRC("CAP END");
 }
 
-void IRCClient::HandleServerMessage(IRCMessage message)
+void IRCClient::HandleServerMessage(IRCNumericEvent const &event)
 {
-    if (message.parameters.empty())
+    std::pmr::vector<std::pmr::string> const &params = event.message->parameters;
+    if (params.empty())
         return;
 
-    std::vector<std::string>::const_iterator itr = message.parameters.begin();
+    std::pmr::vector<std::pmr::string>::const_iterator itr = params.begin();
     ++itr; // skip the first parameter (our nick)
-    for (; itr != message.parameters.end(); ++itr)
+    for (; itr != params.end(); ++itr)
         std::cout << *itr << " ";
     std::cout << std::endl;
 }
@@ -18,25 +18,20 @@
 
 #include "IRCClient.h"
 
-#define NUM_IRC_CMDS 26
+#define NUM_SERVER_NUMERICS 18
 
-struct IRCCommandHandler
-{
-    std::string command;
-    void (IRCClient::*handler)(IRCMessage /*message*/);
-};
-
-extern IRCCommandHandler ircCommandTable[NUM_IRC_CMDS];
+// Numerics printed by IRCClient::HandleServerMessage
+extern int const serverNumericTable[NUM_SERVER_NUMERICS];
 
-inline int GetCommandHandler(std::string command)
+inline bool IsServerNumeric(int code)
 {
-    for (int i = 0; i < NUM_IRC_CMDS; ++i)
+    for (int i = 0; i < NUM_SERVER_NUMERICS; ++i)
     {
-        if (ircCommandTable[i].command == command)
-            return i;
+        if (serverNumericTable[i] == code)
+            return true;
     }
 
-    return NUM_IRC_CMDS;
+    return false;
 }
 
 #endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include <algorithm>
+#include <charconv>
+#include "IRCLag.h"
+
+IRCLag::IRCLag() : _token(0)
+{
+    Reset();
+}
+
+void IRCLag::Reset()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    // First PING goes out as soon as we are registered
+    _next        = clock::time_point::min();
+    _outstanding = false;
+    _missed      = 0;
+    _count       = 0;
+    _average     = 0;
+}
+
+bool IRCLag::Due(clock::time_point now, int interval, unsigned &token)
+{
+    if (now < _next)
+        return false;
+
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_outstanding)
+        ++_missed;
+    _outstanding = true;
+    _sent        = now;
+    _next        = now + std::chrono::milliseconds(interval);
+    token        = ++_token;
+    return true;
+}
+
+bool IRCLag::Received(std::string_view token, clock::time_point now)
+{
+    if (!_outstanding || token.compare(0, sizeof(IRC_LAG_TOKEN) - 1, IRC_LAG_TOKEN) != 0)
+        return false;
+    unsigned value = 0;
+    token.remove_prefix(sizeof(IRC_LAG_TOKEN) - 1);
+    if (std::from_chars(token.data(), token.data() + token.size(), value).ec != std::errc() || value != _token)
+        return false;
+
+    double rtt = std::chrono::duration<double, std::milli>(now - _sent).count();
+
+    std::lock_guard<std::mutex> lock(_lock);
+    _outstanding                       = false;
+    _missed                            = 0;
+    _average                           = _count ? _average + IRC_LAG_EWMA_ALPHA * (rtt - _average) : rtt;
+    _samples[_count % IRC_LAG_SAMPLES] = rtt;
+    ++_count;
+    return true;
+}
+
+IRCLagStats IRCLag::Stats()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    IRCLagStats stats = {};
+    stats.samples     = _count;
+    stats.missed      = _missed;
+    if (!_count)
+        return stats;
+
+    unsigned size = std::min<unsigned>(_count, IRC_LAG_SAMPLES);
+    double sorted[IRC_LAG_SAMPLES];
+    std::copy(_samples, _samples + size, sorted);
+    std::sort(sorted, sorted + size);
+
+    stats.last    = _samples[(_count - 1) % IRC_LAG_SAMPLES];
+    stats.average = _average;
+    stats.p50     = sorted[size * 50 / 100];
+    stats.p90     = sorted[size * 90 / 100];
+    stats.p99     = sorted[size * 99 / 100];
+    return stats;
+}
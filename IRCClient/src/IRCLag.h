@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCLAG_H
+#define _IRCLAG_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#define IRC_PING_INTERVAL 15000
+#define IRC_MAX_MISSED_PONGS 3
+#define IRC_LAG_SAMPLES 64
+// Our PINGs carry this followed by a number
+#define IRC_LAG_TOKEN "lag"
+// Weight of a new sample in the moving average
+#define IRC_LAG_EWMA_ALPHA 0.125
+
+// Round trip times of our own PINGs, in milliseconds
+struct IRCLagStats
+{
+    double last;
+    double average;
+    double p50;
+    double p90;
+    double p99;
+    unsigned samples;
+    // PINGs in a row that got no PONG
+    unsigned missed;
+};
+
+// Sends tokened PINGs and matches their PONGs. Only the receive loop calls
+// Due() and Received(), Stats() may be called from anywhere.
+class IRCLag
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    IRCLag();
+
+    void Reset();
+    // True if a PING is due, token is the number to send after IRC_LAG_TOKEN
+    bool Due(clock::time_point now, int interval, unsigned &token);
+    // True if message was the PONG to our last PING
+    bool Received(std::string_view token, clock::time_point now);
+    unsigned Missed() const
+    {
+        return _missed;
+    };
+
+    IRCLagStats Stats();
+
+private:
+    clock::time_point _sent;
+    clock::time_point _next;
+    unsigned _token;
+    bool _outstanding;
+    unsigned _missed;
+
+    double _samples[IRC_LAG_SAMPLES];
+    unsigned _count;
+    double _average;
+
+    std::mutex _lock;
+};
+
+#endif
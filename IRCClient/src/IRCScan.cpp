@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include <atomic>
+#include "IRCScan.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define IRC_SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*IRCScanFunction)(char const *, size_t, uint16_t *);
+
+// Scans data from offset i on, offsets of the delimiters found are written
+// relative to data
+static inline size_t ScanScalarFrom(char const *data, size_t i, size_t length, uint16_t *offsets)
+{
+    size_t count = 0;
+    for (; i < length; ++i)
+    {
+        char c = data[i];
+        if (c == '\n' || c == ' ' || c == '!' || c == '@')
+            offsets[count++] = static_cast<uint16_t>(i);
+    }
+    return count;
+}
+
+static size_t ScanScalar(char const *data, size_t length, uint16_t *offsets)
+{
+    return ScanScalarFrom(data, 0, length, offsets);
+}
+
+#ifdef IRC_SCAN_X86
+// Appends the offset of every set bit of mask, base being the offset of bit 0
+static inline size_t WriteOffsets(uint32_t mask, size_t base, uint16_t *offsets)
+{
+    size_t count = 0;
+    while (mask)
+    {
+        offsets[count++] = static_cast<uint16_t>(base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+static inline size_t ScanSSE2From(char const *data, size_t i, size_t length, uint16_t *offsets)
+{
+    __m128i const newline = _mm_set1_epi8('\n');
+    __m128i const space   = _mm_set1_epi8(' ');
+    __m128i const bang    = _mm_set1_epi8('!');
+    __m128i const at      = _mm_set1_epi8('@');
+    size_t count          = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+        __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, newline), _mm_cmpeq_epi8(block, space)), _mm_or_si128(_mm_cmpeq_epi8(block, bang), _mm_cmpeq_epi8(block, at)));
+        count += WriteOffsets(static_cast<uint32_t>(_mm_movemask_epi8(found)), i, offsets + count);
+    }
+    return count + ScanScalarFrom(data, i, length, offsets + count);
+}
+
+static size_t ScanSSE2(char const *data, size_t length, uint16_t *offsets)
+{
+    return ScanSSE2From(data, 0, length, offsets);
+}
+
+__attribute__((target("avx2"))) static size_t ScanAVX2(char const *data, size_t length, uint16_t *offsets)
+{
+    __m256i const newline = _mm256_set1_epi8('\n');
+    __m256i const space   = _mm256_set1_epi8(' ');
+    __m256i const bang    = _mm256_set1_epi8('!');
+    __m256i const at      = _mm256_set1_epi8('@');
+    size_t count          = 0;
+    size_t i              = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+        __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, newline), _mm256_cmpeq_epi8(block, space)), _mm256_or_si256(_mm256_cmpeq_epi8(block, bang), _mm256_cmpeq_epi8(block, at)));
+        count += WriteOffsets(static_cast<uint32_t>(_mm256_movemask_epi8(found)), i, offsets + count);
+    }
+    return count + ScanSSE2From(data, i, length, offsets + count);
+}
+#endif
+
+static IRCScanFunction const Functions[] = {
+    ScanScalar,
+#ifdef IRC_SCAN_X86
+    ScanSSE2,
+    ScanAVX2,
+#endif
+};
+
+static IRCScanKernel Best()
+{
+#ifdef IRC_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return IRC_SCAN_AVX2;
+    return IRC_SCAN_SSE2;
+#else
+    return IRC_SCAN_SCALAR;
+#endif
+}
+
+// Picked on first use so it is valid even for static constructors
+static std::atomic<IRCScanKernel> &Current()
+{
+    static std::atomic<IRCScanKernel> kernel(Best());
+    return kernel;
+}
+
+size_t IRCScan::Delimiters(char const *data, size_t length, uint16_t *offsets)
+{
+    return Functions[Current().load(std::memory_order_relaxed)](data, length, offsets);
+}
+
+bool IRCScan::Supported(IRCScanKernel kernel)
+{
+    return kernel <= Best();
+}
+
+bool IRCScan::Select(IRCScanKernel kernel)
+{
+    if (!Supported(kernel))
+        return false;
+    Current() = kernel;
+    return true;
+}
+
+IRCScanKernel IRCScan::Selected()
+{
+    return Current();
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCSCAN_H
+#define _IRCSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum IRCScanKernel
+{
+    IRC_SCAN_SCALAR = 0,
+    IRC_SCAN_SSE2   = 1,
+    IRC_SCAN_AVX2   = 2
+};
+
+// Finds every byte a receive buffer is split on in a single pass: the '\n'
+// ending each line, the spaces between parameters and the '!' and '@' of a
+// prefix. The parser walks the resulting offsets instead of searching the
+// same bytes over and over. The widest kernel the CPU supports is picked on
+// first use.
+namespace IRCScan
+{
+// Writes the offsets of all delimiters in data, in order, to offsets, which
+// needs room for length entries. length must not exceed 65536. Returns how
+// many were found.
+size_t Delimiters(char const *data, size_t length, uint16_t *offsets);
+
+bool Supported(IRCScanKernel kernel);
+// Forces a kernel, for benchmarks. False if the CPU can't run it.
+bool Select(IRCScanKernel kernel);
+IRCScanKernel Selected();
+} // namespace IRCScan
+
+#endif
@@ -13,9 +13,12 @@
  * http://www.gnu.org/licenses/lgpl.html
  */
 
+#include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include "IRCSocket.h"
+#include "IRCCapture.h"
 
 #include <iostream>
 #include <string>
@@ -27,8 +30,25 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
-#define MAXDATASIZE 4096
+IRCSocket::~IRCSocket()
+{
+    Disconnect();
+#ifndef _WIN32
+    if (_wakeFd != -1)
+        close(_wakeFd);
+#ifndef __linux__
+    if (_wakeWriteFd != -1)
+        close(_wakeWriteFd);
+#endif
+#endif
+}
 
 bool IRCSocket::Init()
 {
@@ -60,20 +80,53 @@ bool IRCSocket::Init()
         return false;
     }
 
+    // Small lines should go out right away, dead peers should be noticed
+    // without waiting for the default multi minute retransmission timeout
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char const *) &on, sizeof(on));
+    setsockopt(_socket, SOL_SOCKET, SO_KEEPALIVE, (char const *) &on, sizeof(on));
+#ifdef __linux__
+    int idle = IRC_KEEPALIVE_IDLE, interval = IRC_KEEPALIVE_INTERVAL, count = IRC_KEEPALIVE_COUNT;
+    unsigned timeout = IRC_USER_TIMEOUT;
+    setsockopt(_socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(_socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(_socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#endif
+
 #ifdef _WIN32
-    u_long mode = 0;
+    u_long mode = 1;
     ioctlsocket(_socket, FIONBIO, &mode);
 #else
-    fcntl(_socket, F_SETFL, O_NONBLOCK);
-    fcntl(_socket, F_SETFL, O_ASYNC);
+    fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL) | O_NONBLOCK);
 #endif
 
+    // io_uring is set up by the first Wait(), on the thread that runs the
+    // receive loop
+    _uring.Close();
+    _ringThread = std::thread::id();
+    _active     = _backend;
+
+    std::lock_guard<std::mutex> lock(_sendLock);
+    _sendQueue.clear();
+    _sending = false;
+
+    return true;
+}
+
+bool IRCSocket::SetBackend(IRCSocketBackend backend)
+{
+    if (backend == IRC_BACKEND_URING && !IRCUring::Supported())
+    {
+        _backend = IRC_BACKEND_POLL;
+        return false;
+    }
+    _backend = backend;
     return true;
 }
 
 std::vector<std::string> getipfromhostname(std::string host)
 {
-    struct addrinfo hints, *res;
+    struct addrinfo hints, *res, *head;
     int errcode;
     char addrstr[100];
     void *ptr;
@@ -86,6 +139,7 @@ std::vector<std::string> getipfromhostname(std::string host)
     errcode = getaddrinfo(host.c_str(), NULL, &hints, &res);
     if (errcode != 0)
         return std::vector<std::string>();
+    head = res;
     while (res)
     {
         inet_ntop(res->ai_family, res->ai_addr->sa_data, addrstr, 100);
@@ -103,6 +157,7 @@ std::vector<std::string> getipfromhostname(std::string host)
         addresses.push_back(addrstr);
         res = res->ai_next;
     }
+    freeaddrinfo(head);
     return addresses;
 }
 
@@ -128,50 +183,286 @@ bool IRCSocket::Connect(char const *host, int port)
     addr.sin_addr   = *((const in_addr *) buf);
     memset(&(addr.sin_zero), '\0', 8);
 
-    _connected = true;
     if (connect(_socket, (sockaddr *) &addr, sizeof(addr)) == SOCKET_ERROR)
     {
-        std::cout << "Could not connect to: " << host << std::endl;
-        closesocket(_socket);
-        return false;
+#ifdef _WIN32
+        bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        bool pending = errno == EINPROGRESS;
+#endif
+        // Non blocking connect, wait for it so Wake() can cut it short
+        pollfd fds[2] = { { _socket, POLLOUT, 0 }, { _wakeFd, POLLIN, 0 } };
+        int error     = 0;
+        socklen_t len = sizeof(error);
+        if (!pending || poll(fds, _wakeFd != -1 ? 2 : 1, IRC_CONNECT_TIMEOUT) <= 0 || !(fds[0].revents & POLLOUT) || getsockopt(_socket, SOL_SOCKET, SO_ERROR, (char *) &error, &len) == -1 || error)
+        {
+            std::cout << "Could not connect to: " << host << std::endl;
+            closesocket(_socket);
+            return false;
+        }
     }
 
+    _connected = true;
     return true;
 }
 
 void IRCSocket::Disconnect()
 {
-    if (_connected)
+    if (_connected.exchange(false))
     {
 #ifdef _WIN32
         shutdown(_socket, 2);
 #endif
         closesocket(_socket);
-        _connected = false;
     }
+    // Wakes were meant for this connection. Not cleared in Init(), that
+    // would lose one sent while the next connection is starting up.
+    ClearWake();
 }
 
 bool IRCSocket::SendData(char const *data)
 {
-    if (_connected)
-        if (send(_socket, data, strlen(data), 0) == -1)
-            return false;
+    return SendData(data, strlen(data));
+}
+
+bool IRCSocket::SendData(char const *data, size_t length)
+{
+    if (!_connected)
+        return true;
+
+    std::lock_guard<std::mutex> lock(_sendLock);
+    if (_sendQueue.size() + length > IRC_SEND_QUEUE_LIMIT)
+        return false;
+
+    IRCCapture *capture = _capture;
+    if (capture)
+        capture->Append(IRC_CAPTURE_SEND, data, length);
 
+    // Keep ordering, only write directly if nothing is waiting. Sends made
+    // by handlers on the ring's thread are batched into its next submission.
+    if (_sendQueue.empty() && !_sending && _ringThread.load() != std::this_thread::get_id())
+    {
+        _syscalls++;
+        int sent = send(_socket, data, length, 0);
+        if (sent == (int) length)
+            return true;
+        if (sent == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            sent = 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    _sendQueue.append(data, length);
+    // Let the receive loop wait for the socket to become writable
+    if (_ringThread.load() != std::this_thread::get_id())
+        Wake();
     return true;
 }
 
-std::string IRCSocket::ReceiveData()
+size_t IRCSocket::Queued()
 {
-    char buffer[MAXDATASIZE];
+    std::lock_guard<std::mutex> lock(_sendLock);
+    return _sendQueue.size();
+}
 
-    memset(buffer, 0, MAXDATASIZE);
+bool IRCSocket::WriteQueued()
+{
+    std::lock_guard<std::mutex> lock(_sendLock);
+    if (_sendQueue.empty())
+        return true;
+    _syscalls++;
+    int sent = send(_socket, _sendQueue.data(), _sendQueue.size(), 0);
+    if (sent == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    _sendQueue.erase(0, sent);
+    return true;
+}
 
-    int bytes = recv(_socket, buffer, MAXDATASIZE - 1, 0);
+int IRCSocket::ReceiveData(char *buffer, int size)
+{
+    int bytes;
+    if (_active == IRC_BACKEND_URING)
+    {
+        bytes = _uring.Read(buffer, size);
+        if (bytes == 0)
+            return 0;
+    }
+    else
+    {
+        _syscalls++;
+        bytes = recv(_socket, buffer, size, 0);
+    }
 
     if (bytes > 0)
-        return std::string(buffer);
+    {
+        IRCCapture *capture = _capture;
+        if (capture)
+            capture->Append(IRC_CAPTURE_RECV, buffer, bytes);
+        return bytes;
+    }
+    else if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
     else
         Disconnect();
 
-    return "";
+    return 0;
+}
+
+int IRCSocket::Wait(int timeout)
+{
+    if (!_connected)
+        return IRC_SOCKET_CLOSED;
+    if (_active == IRC_BACKEND_URING)
+        return WaitUring(timeout);
+
+    bool pending;
+    {
+        std::lock_guard<std::mutex> lock(_sendLock);
+        pending = !_sendQueue.empty();
+    }
+
+    pollfd fds[2] = { { _socket, (short) (POLLIN | (pending ? POLLOUT : 0)), 0 }, { _wakeFd, POLLIN, 0 } };
+    _syscalls++;
+    int count = poll(fds, _wakeFd != -1 ? 2 : 1, timeout);
+    if (count <= 0)
+        return IRC_SOCKET_TIMEOUT;
+
+    int events = 0;
+    if (_wakeFd != -1 && fds[1].revents & POLLIN)
+    {
+        ClearWake();
+        events |= IRC_SOCKET_WOKEN;
+    }
+    if (fds[0].revents & POLLOUT && !WriteQueued())
+    {
+        Disconnect();
+        return events | IRC_SOCKET_CLOSED;
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        events |= IRC_SOCKET_READABLE;
+    return events;
+}
+
+int IRCSocket::WaitUring(int timeout)
+{
+    if (!_uring.IsOpen() && !_uring.Open(_socket, _wakeFd))
+    {
+        std::cout << "IRC: io_uring unavailable, using poll." << std::endl;
+        _active = IRC_BACKEND_POLL;
+        return Wait(timeout);
+    }
+    _ringThread = std::this_thread::get_id();
+
+    {
+        // Hand the head of the queue to the ring, SendData() keeps queueing
+        // behind it until it is written
+        std::lock_guard<std::mutex> lock(_sendLock);
+        if (!_uring.Sending())
+        {
+            _sending = false;
+            if (!_sendQueue.empty())
+            {
+                _sendQueue.erase(0, _uring.Send(_sendQueue.data(), _sendQueue.size()));
+                _sending = true;
+            }
+        }
+    }
+
+    int events = _uring.Wait(timeout);
+    if (events & IRC_SOCKET_WOKEN)
+        ClearWake();
+    if (events & IRC_SOCKET_CLOSED)
+        Disconnect();
+    return events;
+}
+
+bool IRCSocket::FlushUring(int timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (_connected && _uring.IsOpen())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_sendLock);
+            if (!_uring.Sending())
+            {
+                _sending = false;
+                if (_sendQueue.empty())
+                    return true;
+                _sendQueue.erase(0, _uring.Send(_sendQueue.data(), _sendQueue.size()));
+                _sending = true;
+            }
+        }
+        int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || _uring.WaitSend(left) & IRC_SOCKET_CLOSED)
+            return false;
+    }
+    return false;
+}
+
+bool IRCSocket::Flush(int timeout)
+{
+    if (_active == IRC_BACKEND_URING && _uring.IsOpen())
+        return FlushUring(timeout);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (_connected)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_sendLock);
+            if (_sendQueue.empty())
+                return true;
+        }
+        pollfd fd = { _socket, POLLOUT, 0 };
+        int left  = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        _syscalls++;
+        if (left <= 0 || poll(&fd, 1, left) <= 0 || !WriteQueued())
+            return false;
+    }
+    return false;
+}
+
+void IRCSocket::OpenWake()
+{
+#ifdef __linux__
+    _wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined(_WIN32)
+    int fds[2];
+    if (pipe(fds) == 0)
+    {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        _wakeFd      = fds[0];
+        _wakeWriteFd = fds[1];
+    }
+#endif
+}
+
+void IRCSocket::Wake()
+{
+    _syscalls++;
+#ifdef __linux__
+    if (_wakeFd != -1)
+        eventfd_write(_wakeFd, 1);
+#elif !defined(_WIN32)
+    char byte = 0;
+    if (_wakeWriteFd != -1 && write(_wakeWriteFd, &byte, 1) == -1)
+        return;
+#endif
+}
+
+void IRCSocket::ClearWake()
+{
+    _syscalls++;
+#ifdef __linux__
+    eventfd_t value;
+    if (_wakeFd != -1)
+        eventfd_read(_wakeFd, &value);
+#elif !defined(_WIN32)
+    char buffer[64];
+    while (_wakeFd != -1 && read(_wakeFd, buffer, sizeof(buffer)) > 0)
+        ;
+#endif
 }
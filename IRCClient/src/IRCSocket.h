@@ -19,11 +19,19 @@
 #include <iostream>
 #include <sstream>
 #include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "IRCUring.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
 #pragma comment(lib, "WS2_32")
+#define poll WSAPoll
 #else
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -35,9 +43,49 @@
 #define INVALID_SOCKET -1
 #endif
 
+// Bounds for blocking socket operations, in milliseconds
+#define IRC_CONNECT_TIMEOUT 10000
+#define IRC_POLL_TIMEOUT 1000
+// TCP keepalive, in seconds
+#define IRC_KEEPALIVE_IDLE 30
+#define IRC_KEEPALIVE_INTERVAL 10
+#define IRC_KEEPALIVE_COUNT 3
+// Unacknowledged data older than this kills the connection, in milliseconds
+#define IRC_USER_TIMEOUT 30000
+// Most bytes waiting to be sent before SendData() starts failing
+#define IRC_SEND_QUEUE_LIMIT 65536
+
+// Results of IRCSocket::Wait()
+enum IRCSocketEvent
+{
+    IRC_SOCKET_TIMEOUT  = 0,
+    IRC_SOCKET_READABLE = 1 << 0,
+    IRC_SOCKET_WOKEN    = 1 << 1,
+    IRC_SOCKET_CLOSED   = 1 << 2
+};
+
+// How the receive loop waits for and moves data
+enum IRCSocketBackend
+{
+    IRC_BACKEND_POLL,
+    // Linux only, falls back to poll where io_uring is unavailable
+    IRC_BACKEND_URING
+};
+
+class IRCCapture;
+
+// All socket operations but SendData() and Wake() belong to the thread
+// running the receive loop. SendData() queues whatever can't be written
+// right away, the receive loop flushes it.
 class IRCSocket
 {
 public:
+    IRCSocket() : _socket(INVALID_SOCKET), _wakeFd(-1), _backend(IRC_BACKEND_POLL), _active(IRC_BACKEND_POLL), _connected(false), _sending(false), _capture(NULL), _syscalls(0)
+    {
+        OpenWake();
+    };
+    ~IRCSocket();
+
     bool Init();
 
     bool Connect(char const *host, int port);
@@ -49,12 +97,72 @@ public:
     };
 
     bool SendData(char const *data);
-    std::string ReceiveData();
+    bool SendData(char const *data, size_t length);
+    // Returns the number of bytes read, 0 if nothing was available or the
+    // connection is gone
+    int ReceiveData(char *buffer, int size);
+
+    // Waits up to timeout ms for data or a Wake(), flushing queued sends
+    // while waiting. Returns a mask of IRCSocketEvent.
+    int Wait(int timeout);
+    // Writes queued data until the queue is empty or timeout ms passed
+    bool Flush(int timeout);
+    // Makes a Wait() or Connect() in another thread return immediately
+    void Wake();
+
+    // Takes effect on the next Init(). Returns false and keeps using poll if
+    // the backend is not supported here.
+    bool SetBackend(IRCSocketBackend backend);
+    // Backend of the current connection
+    IRCSocketBackend Backend()
+    {
+        return _active;
+    };
+    // Bytes waiting to be written
+    size_t Queued();
+    // Socket related system calls made so far
+    uint64_t Syscalls()
+    {
+        return _syscalls + _uring.Syscalls();
+    };
+
+    // Records all traffic into capture, NULL to stop
+    void SetCapture(IRCCapture *capture)
+    {
+        _capture = capture;
+    };
 
 private:
+    bool WriteQueued();
+    // Created once so a Wake() before Init() is not lost
+    void OpenWake();
+    void ClearWake();
+    int WaitUring(int timeout);
+    bool FlushUring(int timeout);
+
     int _socket;
+    // eventfd (or pipe read end) that interrupts poll()
+    int _wakeFd;
+#if !defined(_WIN32) && !defined(__linux__)
+    int _wakeWriteFd = -1;
+#endif
+
+    std::atomic<IRCSocketBackend> _backend;
+    // Backend picked by Init(), only touched by the receive loop
+    IRCSocketBackend _active;
+    IRCUring _uring;
+    // Thread that owns the ring, its sends are picked up by its next Wait()
+    std::atomic<std::thread::id> _ringThread;
+
+    std::atomic<bool> _connected;
+
+    std::mutex _sendLock;
+    std::string _sendQueue;
+    // The ring owns the head of the queue, nothing may bypass it
+    bool _sending;
 
-    bool _connected;
+    std::atomic<IRCCapture *> _capture;
+    std::atomic<uint64_t> _syscalls;
 };
 
 #endif
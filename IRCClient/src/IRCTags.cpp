@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include <charconv>
+#include "IRCTags.h"
+
+bool IRCTags::Get(std::string_view key, std::string_view &value) const
+{
+    bool found = false;
+    ForEach([&](std::string_view tagKey, std::string_view tagValue) {
+        // A repeated tag counts as its last value
+        if (tagKey == key)
+        {
+            value = tagValue;
+            found = true;
+        }
+    });
+    return found;
+}
+
+// Reads exactly width digits at pos
+static bool ReadDigits(std::string_view text, size_t &pos, size_t width, int &out)
+{
+    if (text.size() < pos + width)
+        return false;
+    char const *begin             = text.data() + pos;
+    std::from_chars_result result = std::from_chars(begin, begin + width, out);
+    if (result.ec != std::errc() || result.ptr != begin + width)
+        return false;
+    pos += width;
+    return true;
+}
+
+static bool Expect(std::string_view text, size_t &pos, char c)
+{
+    if (pos >= text.size() || text[pos] != c)
+        return false;
+    ++pos;
+    return true;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+static int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    int64_t era  = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe = unsigned(year - era * 400);
+    unsigned doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + int64_t(doe) - 719468;
+}
+
+bool IRCTags::ServerTime(std::chrono::system_clock::time_point &time) const
+{
+    // YYYY-MM-DDThh:mm:ss.sssZ, always UTC
+    std::string_view value;
+    if (!Get("time", value))
+        return false;
+    size_t pos = 0;
+    int year, month, day, hour, minute, second, millisecond = 0;
+    if (!ReadDigits(value, pos, 4, year) || !Expect(value, pos, '-') || !ReadDigits(value, pos, 2, month) || !Expect(value, pos, '-') || !ReadDigits(value, pos, 2, day) || !Expect(value, pos, 'T') || !ReadDigits(value, pos, 2, hour) || !Expect(value, pos, ':') || !ReadDigits(value, pos, 2, minute) || !Expect(value, pos, ':') || !ReadDigits(value, pos, 2, second))
+        return false;
+    if (Expect(value, pos, '.') && !ReadDigits(value, pos, 3, millisecond))
+        return false;
+    if (!Expect(value, pos, 'Z') || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return false;
+
+    int64_t seconds = DaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    time            = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::seconds(seconds) + std::chrono::milliseconds(millisecond)));
+    return true;
+}
+
+void IRCTags::Unescape(std::string_view value, std::string &out)
+{
+    out.clear();
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] != '\\')
+        {
+            out += value[i];
+            continue;
+        }
+        // A lone trailing backslash is dropped
+        if (++i == value.size())
+            break;
+        switch (value[i])
+        {
+        case ':':
+            out += ';';
+            break;
+        case 's':
+            out += ' ';
+            break;
+        case 'r':
+            out += '\r';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        default:
+            out += value[i];
+        }
+    }
+}
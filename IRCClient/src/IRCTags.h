@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCTAGS_H
+#define _IRCTAGS_H
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+// IRCv3 message tags, the part of a line between the leading '@' and the
+// first space. Nothing is copied, keys and values are views into the
+// received line and only valid while its message is being dispatched.
+// Values are as sent, Unescape() resolves the \: \s \\ \r \n escapes.
+class IRCTags
+{
+public:
+    IRCTags(std::string_view raw = std::string_view()) : _raw(raw){};
+
+    bool Empty() const
+    {
+        return _raw.empty();
+    };
+    // Without the '@'
+    std::string_view Raw() const
+    {
+        return _raw;
+    };
+
+    // Value of the tag key, empty for a tag without one. False if missing.
+    bool Get(std::string_view /*key*/, std::string_view & /*value*/) const;
+
+    // Calls function(key, value) for every tag
+    template <typename F> void ForEach(F function) const
+    {
+        std::string_view rest = _raw;
+        while (!rest.empty())
+        {
+            size_t end           = rest.find(';');
+            std::string_view tag = rest.substr(0, end);
+            size_t equals        = tag.find('=');
+            if (!tag.empty())
+                function(tag.substr(0, equals), equals == std::string_view::npos ? std::string_view() : tag.substr(equals + 1));
+            if (end == std::string_view::npos)
+                break;
+            rest.remove_prefix(end + 1);
+        }
+    };
+
+    // When the server got the message, from the server-time tag. False if
+    // it is missing or malformed.
+    bool ServerTime(std::chrono::system_clock::time_point & /*time*/) const;
+
+    static void Unescape(std::string_view /*value*/, std::string & /*out*/);
+
+private:
+    std::string_view _raw;
+};
+
+#endif
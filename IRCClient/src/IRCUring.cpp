@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include <cerrno>
+#include <cstring>
+#include "IRCUring.h"
+#include "IRCSocket.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define IRC_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// user_data of each operation
+enum
+{
+    URING_RECV = 1,
+    URING_WAKE,
+    URING_SEND
+};
+
+IRCUring::IRCUring() : _ringFd(-1), _socket(-1), _wakeFd(-1), _ring(NULL), _ringSize(0), _sqes(NULL), _sqesSize(0), _sqHead(NULL), _sqTail(NULL), _sqMask(0), _sqEntries(0), _sqLocalTail(0), _cqHead(NULL), _cqTail(NULL), _cqMask(0), _cqes(NULL), _bufRing(NULL), _bufRingSize(0), _recvBuffers(NULL), _bufTail(0), _readyHead(0), _readyCount(0), _sendBuffer(NULL), _sendOffset(0), _sendLength(0), _recvArmed(false), _multishot(true), _wakeArmed(false), _closed(false), _syscalls(0)
+{
+}
+
+IRCUring::~IRCUring()
+{
+    Close();
+    delete[] _recvBuffers;
+    delete[] _sendBuffer;
+}
+
+#ifdef IRC_HAVE_URING
+
+static int SetupRing(unsigned entries, io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int RegisterRing(int fd, unsigned opcode, void *arg, unsigned count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+bool IRCUring::Supported()
+{
+    static int supported = -1;
+    if (supported != -1)
+        return supported;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = SetupRing(2, &params);
+    if (fd == -1)
+    {
+        supported = 0;
+        return false;
+    }
+
+    // Provided buffer rings are the newest thing we depend on (5.19)
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    void *ring = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    reg.ring_addr    = (uint64_t) ring;
+    reg.ring_entries = 1;
+    supported        = (params.features & IORING_FEAT_SINGLE_MMAP) && (params.features & IORING_FEAT_EXT_ARG) && ring != MAP_FAILED && RegisterRing(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+    if (ring != MAP_FAILED)
+        munmap(ring, 4096);
+    close(fd);
+    return supported;
+}
+
+bool IRCUring::Open(int socket, int wakeFd)
+{
+    Close();
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Only the receive loop ever submits, let completions wait for it
+    // instead of interrupting it
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    _ringFd      = SetupRing(IRC_URING_ENTRIES, &params);
+    if (_ringFd == -1 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        _ringFd = SetupRing(IRC_URING_ENTRIES, &params);
+    }
+    if (_ringFd == -1)
+        return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        Close();
+        return false;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    _ringSize     = sqSize > cqSize ? sqSize : cqSize;
+    _ring         = mmap(NULL, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+    _sqesSize     = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes         = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+    if (_ring == MAP_FAILED || _sqes == MAP_FAILED)
+    {
+        if (_ring == MAP_FAILED)
+            _ring = NULL;
+        if (_sqes == MAP_FAILED)
+            _sqes = NULL;
+        Close();
+        return false;
+    }
+
+    char *ring   = static_cast<char *>(_ring);
+    _sqHead      = (unsigned *) (ring + params.sq_off.head);
+    _sqTail      = (unsigned *) (ring + params.sq_off.tail);
+    _sqMask      = *(unsigned *) (ring + params.sq_off.ring_mask);
+    _sqEntries   = params.sq_entries;
+    _sqLocalTail = *_sqTail;
+    _cqHead      = (unsigned *) (ring + params.cq_off.head);
+    _cqTail      = (unsigned *) (ring + params.cq_off.tail);
+    _cqMask      = *(unsigned *) (ring + params.cq_off.ring_mask);
+    _cqes        = ring + params.cq_off.cqes;
+    // Slot i of the submission ring always points at sqe i
+    unsigned *array = (unsigned *) (ring + params.sq_off.array);
+    for (unsigned i = 0; i < _sqEntries; i++)
+        array[i] = i;
+
+    if (!_recvBuffers)
+        _recvBuffers = new char[IRC_URING_RECV_BUFFERS * IRC_URING_RECV_BUFFER_SIZE];
+    if (!_sendBuffer)
+        _sendBuffer = new char[IRC_URING_SEND_BUFFER_SIZE];
+
+    _bufRingSize = (IRC_URING_RECV_BUFFERS * sizeof(io_uring_buf) + 4095) & ~(size_t) 4095;
+    _bufRing     = mmap(NULL, _bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_bufRing == MAP_FAILED)
+    {
+        _bufRing = NULL;
+        Close();
+        return false;
+    }
+    // Start from an empty ring, with its page faulted in before the kernel
+    // pins it
+    memset(_bufRing, 0, _bufRingSize);
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t) _bufRing;
+    reg.ring_entries = IRC_URING_RECV_BUFFERS;
+    reg.bgid         = 0;
+    if (RegisterRing(_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        Close();
+        return false;
+    }
+    _bufTail = 0;
+    for (unsigned short bid = 0; bid < IRC_URING_RECV_BUFFERS; bid++)
+        Recycle(bid);
+
+    _socket     = socket;
+    _wakeFd     = wakeFd;
+    _readyHead  = 0;
+    _readyCount = 0;
+    _sendOffset = 0;
+    _sendLength = 0;
+    _recvArmed  = false;
+    _multishot  = true;
+    _wakeArmed  = false;
+    _closed     = false;
+    return true;
+}
+
+void IRCUring::Close()
+{
+    // Closing the ring cancels whatever is still in flight
+    if (_ringFd != -1)
+        close(_ringFd);
+    if (_ring)
+        munmap(_ring, _ringSize);
+    if (_sqes)
+        munmap(_sqes, _sqesSize);
+    if (_bufRing)
+        munmap(_bufRing, _bufRingSize);
+    _ringFd  = -1;
+    _ring    = NULL;
+    _sqes    = NULL;
+    _bufRing = NULL;
+}
+
+void *IRCUring::NextSqe()
+{
+    unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    if (_sqLocalTail - head >= _sqEntries)
+        return NULL;
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(_sqes) + (_sqLocalTail & _sqMask);
+    memset(sqe, 0, sizeof(*sqe));
+    _sqLocalTail++;
+    return sqe;
+}
+
+void IRCUring::ArmRecv()
+{
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(NextSqe());
+    if (!sqe)
+        return;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = _socket;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio    = _multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = URING_RECV;
+    _recvArmed     = true;
+}
+
+void IRCUring::ArmWake()
+{
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(NextSqe());
+    if (!sqe)
+        return;
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = _wakeFd;
+    sqe->poll32_events = POLLIN;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->user_data     = URING_WAKE;
+    _wakeArmed         = true;
+}
+
+void IRCUring::ArmSend()
+{
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(NextSqe());
+    if (!sqe)
+        return;
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = _socket;
+    sqe->addr      = (uint64_t) (_sendBuffer + _sendOffset);
+    sqe->len       = _sendLength - _sendOffset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_SEND;
+}
+
+void IRCUring::Recycle(unsigned short bid)
+{
+    // Index the entries by hand, in C++ the header's flex array member
+    // comes after an empty struct that takes up space
+    io_uring_buf_ring *ring = static_cast<io_uring_buf_ring *>(_bufRing);
+    io_uring_buf &buf       = static_cast<io_uring_buf *>(_bufRing)[_bufTail & (IRC_URING_RECV_BUFFERS - 1)];
+    buf.addr                = (uint64_t) (_recvBuffers + bid * IRC_URING_RECV_BUFFER_SIZE);
+    buf.len                 = IRC_URING_RECV_BUFFER_SIZE;
+    buf.bid                 = bid;
+    __atomic_store_n(&ring->tail, ++_bufTail, __ATOMIC_RELEASE);
+}
+
+size_t IRCUring::Send(char const *data, size_t length)
+{
+    if (Sending() || !IsOpen())
+        return 0;
+    if (length > IRC_URING_SEND_BUFFER_SIZE)
+        length = IRC_URING_SEND_BUFFER_SIZE;
+    memcpy(_sendBuffer, data, length);
+    _sendOffset = 0;
+    _sendLength = length;
+    ArmSend();
+    return length;
+}
+
+int IRCUring::Enter(unsigned wait, int timeout)
+{
+    __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+    unsigned submit = _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeout >= 0)
+    {
+        ts.tv_sec  = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts     = (uint64_t) &ts;
+    }
+    _syscalls++;
+    int ret = syscall(__NR_io_uring_enter, _ringFd, submit, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret == -1 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        _closed = true;
+    return ret;
+}
+
+int IRCUring::Complete(uint64_t tag, int result, unsigned flags)
+{
+    switch (tag)
+    {
+    case URING_RECV:
+        if (!(flags & IORING_CQE_F_MORE))
+            _recvArmed = false;
+        if (result > 0)
+        {
+            Ready &ready = _ready[(_readyHead + _readyCount++) % IRC_URING_RECV_BUFFERS];
+            ready.bid    = flags >> IORING_CQE_BUFFER_SHIFT;
+            ready.length = result;
+            ready.offset = 0;
+        }
+        // Out of buffers, rearmed once Read() gives some back
+        else if (result == -ENOBUFS || result == -EINTR || result == -ECANCELED)
+            ;
+        // Kernels before 6.0 reject multishot recv, fall back to one shot
+        else if (result == -EINVAL && _multishot)
+            _multishot = false;
+        else
+            _closed = true;
+        return 0;
+    case URING_WAKE:
+        if (!(flags & IORING_CQE_F_MORE))
+            _wakeArmed = false;
+        return result > 0 ? IRC_SOCKET_WOKEN : 0;
+    case URING_SEND:
+        if (result < 0)
+        {
+            if (result != -EAGAIN && result != -EINTR)
+            {
+                _closed     = true;
+                _sendLength = 0;
+                return 0;
+            }
+        }
+        else
+            _sendOffset += result;
+        if (_sendOffset < _sendLength)
+            ArmSend();
+        else
+            _sendLength = 0;
+        return 0;
+    }
+    return 0;
+}
+
+int IRCUring::Reap()
+{
+    int events    = 0;
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        io_uring_cqe *cqe = static_cast<io_uring_cqe *>(_cqes) + (head & _cqMask);
+        events |= Complete(cqe->user_data, cqe->res, cqe->flags);
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    return events;
+}
+
+int IRCUring::Events()
+{
+    // Arm what completed for good, a multishot recv that ran out of
+    // buffers waits until at least one is free again
+    if (!_recvArmed && !_closed && _readyCount < IRC_URING_RECV_BUFFERS)
+        ArmRecv();
+    if (!_wakeArmed && _wakeFd != -1)
+        ArmWake();
+    return Reap();
+}
+
+int IRCUring::Wait(int timeout)
+{
+    if (!IsOpen())
+        return IRC_SOCKET_CLOSED;
+
+    int events = Events();
+    bool ready = events || _readyCount || _closed;
+    if (_sqLocalTail != __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) || !ready)
+    {
+        Enter(ready ? 0 : 1, timeout);
+        events |= Reap();
+    }
+
+    if (_readyCount)
+        events |= IRC_SOCKET_READABLE;
+    else if (_closed)
+        events |= IRC_SOCKET_CLOSED;
+    return events;
+}
+
+int IRCUring::WaitSend(int timeout)
+{
+    if (!IsOpen())
+        return IRC_SOCKET_CLOSED;
+
+    int events = Events();
+    if (Sending() && !_closed)
+    {
+        Enter(1, timeout);
+        events |= Reap();
+    }
+    if (_closed)
+        events |= IRC_SOCKET_CLOSED;
+    return events;
+}
+
+size_t IRCUring::Read(char *buffer, size_t size)
+{
+    size_t copied = 0;
+    while (_readyCount && copied < size)
+    {
+        Ready &ready = _ready[_readyHead];
+        size_t count = ready.length - ready.offset;
+        if (count > size - copied)
+            count = size - copied;
+        memcpy(buffer + copied, _recvBuffers + ready.bid * IRC_URING_RECV_BUFFER_SIZE + ready.offset, count);
+        ready.offset += count;
+        copied += count;
+        if (ready.offset == ready.length)
+        {
+            Recycle(ready.bid);
+            _readyHead = (_readyHead + 1) % IRC_URING_RECV_BUFFERS;
+            _readyCount--;
+        }
+    }
+    return copied;
+}
+
+#else
+
+bool IRCUring::Supported()
+{
+    return false;
+}
+
+bool IRCUring::Open(int, int)
+{
+    return false;
+}
+
+void IRCUring::Close()
+{
+}
+
+size_t IRCUring::Send(char const *, size_t)
+{
+    return 0;
+}
+
+int IRCUring::Wait(int)
+{
+    return IRC_SOCKET_CLOSED;
+}
+
+int IRCUring::WaitSend(int)
+{
+    return IRC_SOCKET_CLOSED;
+}
+
+size_t IRCUring::Read(char *, size_t)
+{
+    return 0;
+}
+
+#endif
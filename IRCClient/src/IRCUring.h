@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2011 Fredi Machado <https://github.com/fredimachado>
+ * IRCClient is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IRCURING_H
+#define _IRCURING_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define IRC_URING_ENTRIES 16
+// Provided receive buffers, the count must be a power of two
+#define IRC_URING_RECV_BUFFERS 16
+#define IRC_URING_RECV_BUFFER_SIZE 4096
+// Largest chunk of the send queue in flight at once
+#define IRC_URING_SEND_BUFFER_SIZE 16384
+
+// io_uring driven socket I/O, used by IRCSocket when the io_uring backend
+// is selected. One multishot recv fills kernel provided buffers and a
+// multishot poll watches the wake fd, so a busy connection gets all its
+// reads and writes done by one io_uring_enter() per Wait().
+// Everything but Close() belongs to the thread running the receive loop.
+class IRCUring
+{
+public:
+    IRCUring();
+    ~IRCUring();
+
+    IRCUring(IRCUring const &) = delete;
+    IRCUring &operator=(IRCUring const &) = delete;
+
+    // Whether this kernel can run the backend at all
+    static bool Supported();
+
+    bool Open(int socket, int wakeFd);
+    void Close();
+    bool IsOpen() const
+    {
+        return _ringFd != -1;
+    };
+
+    // True until the last chunk handed to Send() is written
+    bool Sending() const
+    {
+        return _sendLength != 0;
+    };
+    // Takes up to IRC_URING_SEND_BUFFER_SIZE bytes of data for writing,
+    // returns how many were taken
+    size_t Send(char const *data, size_t length);
+
+    // Submits what is queued and waits up to timeout ms for completions,
+    // returns right away if received data is waiting. Returns a mask of
+    // IRCSocketEvent.
+    int Wait(int timeout);
+    // Like Wait() but only returns early for completed writes
+    int WaitSend(int timeout);
+    // Copies received data into buffer, returns the number of bytes copied
+    size_t Read(char *buffer, size_t size);
+
+    // io_uring_enter() calls made so far
+    uint64_t Syscalls() const
+    {
+        return _syscalls;
+    };
+
+private:
+    void *NextSqe();
+    void ArmRecv();
+    void ArmWake();
+    void ArmSend();
+    void Recycle(unsigned short bid);
+    int Enter(unsigned wait, int timeout);
+    int Reap();
+    int Complete(uint64_t tag, int result, unsigned flags);
+    int Events();
+
+    int _ringFd;
+    int _socket;
+    int _wakeFd;
+
+    // Submission and completion rings, mapped from the kernel
+    void *_ring;
+    size_t _ringSize;
+    void *_sqes;
+    size_t _sqesSize;
+    unsigned *_sqHead;
+    unsigned *_sqTail;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned _sqLocalTail;
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    void *_cqes;
+
+    // Buffer ring the kernel picks receive buffers from
+    void *_bufRing;
+    size_t _bufRingSize;
+    char *_recvBuffers;
+    unsigned short _bufTail;
+
+    // Filled receive buffers in arrival order
+    struct Ready
+    {
+        unsigned short bid;
+        unsigned length;
+        unsigned offset;
+    };
+    Ready _ready[IRC_URING_RECV_BUFFERS];
+    unsigned _readyHead;
+    unsigned _readyCount;
+
+    char *_sendBuffer;
+    size_t _sendOffset;
+    size_t _sendLength;
+
+    bool _recvArmed;
+    bool _multishot;
+    bool _wakeArmed;
+    bool _closed;
+
+    uint64_t _syscalls;
+};
+
+#endif
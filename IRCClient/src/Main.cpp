@@ -92,7 +92,7 @@ void msgCommand(std::string arguments, IRCClient *client)
     std::string text = arguments.substr(arguments.find(" ") + 1);
 
     std::cout << "To " + to + ": " + text << std::endl;
-    client->SendIRC("PRIVMSG " + to + " :" + text);
+    client->SendIRC("PRIVMSG ", to, " :", text);
 };
 
 void joinCommand(std::string channel, IRCClient *client)
@@ -100,7 +100,7 @@ void joinCommand(std::string channel, IRCClient *client)
     if (channel[0] != '#')
         channel = "#" + channel;
 
-    client->SendIRC("JOIN " + channel);
+    client->SendIRC("JOIN ", channel);
 }
 
 void partCommand(std::string channel, IRCClient *client)
@@ -108,7 +108,7 @@ void partCommand(std::string channel, IRCClient *client)
     if (channel[0] != '#')
         channel = "#" + channel;
 
-    client->SendIRC("PART " + channel);
+    client->SendIRC("PART ", channel);
 }
 
 void ctcpCommand(std::string arguments, IRCClient *client)
@@ -118,7 +118,7 @@ void ctcpCommand(std::string arguments, IRCClient *client)
 
     std::transform(text.begin(), text.end(), text.begin(), towupper);
 
-    client->SendIRC("PRIVMSG " + to + " :\001" + text + "\001");
+    client->SendIRC("PRIVMSG ", to, " :\001", text, '\001');
 }
 
 ThreadReturn inputThread(void *client)
@@ -0,0 +1,487 @@
+// Counts heap allocations per line on the hot paths and fails if any path
+// goes over its budget, so allocation behaviour can't regress silently.
+//
+// A corpus of inbound lines is replayed through IRCClient::Parse() on its
+// own and through a ChIRC connected to a loopback server, which adds the
+// socket and ChIRC::basicHandler(). Outbound lines go through privmsg() and
+// sendraw(). Every path runs once to warm up and once counted.
+//
+//   allocbench [path=budget ...] [corpus=file] [passes=n]
+//
+// Paths are parse, handler, privmsg and sendraw. A corpus file holds one
+// inbound line per line, the built in one is used otherwise. Exits with 1
+// if a path allocated more per line than its budget.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <execinfo.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../ucccccp/ucccccp.hpp"
+#include "ChIRC.hpp"
+#include "IRCClient.h"
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void *__libc_memalign(size_t, size_t);
+extern "C" void __libc_free(void *);
+
+// Backtraces kept per counted path to show where it allocated
+constexpr int traces_kept  = 4;
+constexpr int trace_frames = 16;
+
+static std::atomic<bool> counting{ false };
+static std::atomic<uint64_t> allocations{ 0 };
+static std::atomic<uint64_t> allocated_bytes{ 0 };
+static std::atomic<int> traces_taken{ 0 };
+static void *traces[traces_kept][trace_frames];
+static int trace_sizes[traces_kept];
+// Set on threads that belong to the harness, and while taking a backtrace
+static thread_local bool uncounted = false;
+
+static void countAllocation(size_t size)
+{
+    if (!counting.load(std::memory_order_relaxed) || uncounted)
+        return;
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    int trace = traces_taken.fetch_add(1, std::memory_order_relaxed);
+    if (trace >= traces_kept)
+        return;
+    uncounted          = true;
+    trace_sizes[trace] = backtrace(traces[trace], trace_frames);
+    uncounted          = false;
+}
+
+extern "C" void *malloc(size_t size)
+{
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+void *operator new(size_t size)
+{
+    countAllocation(size);
+    if (void *ptr = __libc_malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    countAllocation(size);
+    return __libc_malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    countAllocation(size);
+    if (void *ptr = __libc_memalign(size_t(align), size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    __libc_free(ptr);
+}
+
+struct BenchPath
+{
+    const char *name;
+    // Most allocations per line allowed in steady state
+    double budget;
+    uint64_t lines;
+    uint64_t allocations;
+    uint64_t bytes;
+    int traces;
+    void *frames[traces_kept][trace_frames];
+    int sizes[traces_kept];
+};
+
+// What the paths allocate today. Raise a budget in the change that needs it,
+// never to make a run pass.
+static BenchPath paths[] = {
+    { "parse", 0.0, 0, 0, 0, 0, {}, {} },
+    { "handler", 2.3, 0, 0, 0, 0, {}, {} },
+    { "privmsg", 3.0, 0, 0, 0, 0, {}, {} },
+    { "sendraw", 0.0, 0, 0, 0, 0, {}, {} },
+};
+
+static BenchPath *findPath(const std::string &name)
+{
+    for (auto &path : paths)
+        if (name == path.name)
+            return &path;
+    return nullptr;
+}
+
+static void startCounting()
+{
+    allocations     = 0;
+    allocated_bytes = 0;
+    traces_taken    = 0;
+    counting        = true;
+}
+
+static void stopCounting(BenchPath &path, uint64_t lines)
+{
+    counting          = false;
+    path.lines        = lines;
+    path.allocations  = allocations;
+    path.bytes        = allocated_bytes;
+    path.traces       = std::min<int>(traces_taken, traces_kept);
+    for (int i = 0; i < path.traces; i++)
+    {
+        memcpy(path.frames[i], traces[i], sizeof(traces[i]));
+        path.sizes[i] = trace_sizes[i];
+    }
+}
+
+static std::vector<std::string> defaultCorpus()
+{
+    std::string heartbeat = ucccccp::encrypt("cc_hb$17$1$0", 'B');
+    std::string packed    = ucccccp::encrypt("cc_hb$42$3$1;cc_hb$43$2$0;cc_hb$44$1$1", 'B');
+    std::string auth      = ucccccp::encrypt("cc_auth$17$0$38000017$1", 'B');
+    return {
+        ":peer-17!user@host PRIVMSG #comms :the quick brown fox jumps over the lazy dog",
+        ":peer-17!user@host PRIVMSG #cc :" + heartbeat,
+        ":peer-42!user@host PRIVMSG #cc :" + packed,
+        ":peer-17!user@host PRIVMSG #cc :" + auth,
+        ":peer-17!user@host NOTICE #comms :a notice nobody reads",
+        ":srv 353 bench = #cc :@peer-17 +peer-42 peer-43 peer-44",
+        ":srv 366 bench #cc :End of /NAMES list.",
+        ":peer-99!user@host JOIN #comms",
+        ":peer-99!user@host PART #comms :leaving",
+        ":srv 372 bench :- message of the day",
+    };
+}
+
+// Loopback IRC server. Welcomes the client, sends whatever it is given and
+// keeps count of what comes back.
+struct BenchServer
+{
+    int listener{ -1 };
+    int fd{ -1 };
+    int port{ 0 };
+    std::thread reader;
+    std::atomic<bool> joined{ false };
+    std::atomic<uint64_t> privmsgs{ 0 };
+    std::atomic<uint64_t> pongs{ 0 };
+
+    bool listen()
+    {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length     = sizeof(addr);
+        if (listener == -1 || bind(listener, (sockaddr *) &addr, sizeof(addr)) || ::listen(listener, 1) || getsockname(listener, (sockaddr *) &addr, &length))
+            return false;
+        port = ntohs(addr.sin_port);
+        return true;
+    }
+
+    void accept()
+    {
+        fd     = ::accept(listener, nullptr, nullptr);
+        reader = std::thread(&BenchServer::read, this);
+    }
+
+    void read()
+    {
+        uncounted = true;
+        std::string buffer;
+        char chunk[16384];
+        ssize_t bytes;
+        while ((bytes = recv(fd, chunk, sizeof(chunk), 0)) > 0)
+        {
+            buffer.append(chunk, bytes);
+            size_t start = 0, end;
+            while ((end = buffer.find("\r\n", start)) != std::string::npos)
+            {
+                std::string_view line(buffer.data() + start, end - start);
+                start = end + 2;
+                if (line.compare(0, 8, "PRIVMSG ") == 0)
+                    privmsgs++;
+                else if (line.compare(0, 5, "USER ") == 0)
+                    write(":srv 001 bench :Welcome\r\n");
+                else if (line.compare(0, 8, "JOIN #cc") == 0)
+                {
+                    // ChIRC only sends C&C records once it sees its JOIN
+                    write(":bench!bench@127.0.0.1 JOIN #cc\r\n");
+                    joined = true;
+                }
+                else if (line.compare(0, 11, "PONG :bench") == 0)
+                    pongs++;
+            }
+            buffer.erase(0, start);
+        }
+    }
+
+    void write(std::string_view data)
+    {
+        for (size_t done = 0; done < data.size();)
+        {
+            ssize_t sent = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (sent <= 0)
+                return;
+            done += sent;
+        }
+    }
+
+    void close()
+    {
+        if (fd != -1)
+            shutdown(fd, SHUT_RDWR);
+        if (reader.joinable())
+            reader.join();
+        if (fd != -1)
+            ::close(fd);
+        if (listener != -1)
+            ::close(listener);
+    }
+};
+
+template <typename F> static bool waitFor(F &&done, int timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static void runParse(const std::vector<std::string> &corpus, int passes)
+{
+    IRCClient client;
+    for (auto &line : corpus)
+        client.Parse(line);
+    startCounting();
+    for (int pass = 0; pass < passes; pass++)
+        for (auto &line : corpus)
+            client.Parse(line);
+    stopCounting(*findPath("parse"), uint64_t(passes) * corpus.size());
+}
+
+static bool runChIRC(const std::vector<std::string> &corpus, int passes)
+{
+    BenchServer server;
+    if (!server.listen())
+        return false;
+    std::thread acceptor(&BenchServer::accept, &server);
+    ChIRC::ChIRC chirc;
+    chirc.UpdateData("bench", "bench", "#comms", "#cc", "key", "127.0.0.1", server.port, false, 0);
+    chirc.Connect();
+    acceptor.join();
+    // ChIRC joins a second after logging in
+    if (!waitFor([&] { return server.joined.load(); }, 5000))
+    {
+        server.close();
+        return false;
+    }
+
+    // The PING at the end of a batch tells us the client got through it
+    std::string batch;
+    for (int pass = 0; pass < passes; pass++)
+        for (auto &line : corpus)
+            batch += line + "\r\n";
+    batch += "PING :bench\r\n";
+    bool ok = true;
+    for (int round = 0; round < 2 && ok; round++)
+    {
+        uint64_t pongs = server.pongs;
+        if (round)
+            startCounting();
+        server.write(batch);
+        ok = waitFor([&] { return server.pongs > pongs; }, 10000);
+        if (round)
+            stopCounting(*findPath("handler"), uint64_t(passes) * corpus.size());
+    }
+
+    std::string text(100, 'x');
+    uint64_t lines = uint64_t(passes) * corpus.size();
+    for (int round = 0; round < 2 && ok; round++)
+    {
+        uint64_t privmsgs = server.privmsgs;
+        if (round)
+            startCounting();
+        for (uint64_t i = 0; i < lines; i++)
+            chirc.privmsg(text);
+        if (round)
+            stopCounting(*findPath("privmsg"), lines);
+        ok = waitFor([&] { return server.privmsgs >= privmsgs + lines; }, 10000);
+    }
+    for (int round = 0; round < 2 && ok; round++)
+    {
+        uint64_t privmsgs = server.privmsgs;
+        if (round)
+            startCounting();
+        for (uint64_t i = 0; i < lines; i++)
+            chirc.sendraw("PRIVMSG #comms :the quick brown fox jumps over the lazy dog");
+        if (round)
+            stopCounting(*findPath("sendraw"), lines);
+        ok = waitFor([&] { return server.privmsgs >= privmsgs + lines; }, 10000);
+    }
+
+    chirc.Disconnect();
+    server.close();
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> corpus = defaultCorpus();
+    int passes                      = 100;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        size_t equals = arg.find('=');
+        std::string name(arg.substr(0, equals));
+        std::string value(equals == std::string::npos ? "" : arg.substr(equals + 1));
+        if (name == "corpus")
+        {
+            std::ifstream file(value);
+            corpus.clear();
+            for (std::string line; std::getline(file, line);)
+            {
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                if (!line.empty())
+                    corpus.push_back(line);
+            }
+        }
+        else if (name == "passes")
+            passes = std::max(1, atoi(value.c_str()));
+        else if (BenchPath *path = findPath(name))
+            path->budget = atof(value.c_str());
+        else
+        {
+            fprintf(stderr, "usage: %s [parse|handler|privmsg|sendraw=budget ...] [corpus=file] [passes=n]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (corpus.empty())
+    {
+        fprintf(stderr, "allocbench: empty corpus\n");
+        return 2;
+    }
+
+    // The default handlers print every message, keep the console clean
+    std::cout.rdbuf(nullptr);
+    // backtrace() allocates the first time it is called
+    void *warmup[1];
+    backtrace(warmup, 1);
+
+    runParse(corpus, passes);
+    if (!runChIRC(corpus, passes))
+    {
+        fprintf(stderr, "allocbench: loopback session failed\n");
+        return 2;
+    }
+
+    bool failed = false;
+    printf("%-9s %9s %12s %12s %8s\n", "path", "lines", "allocs/line", "bytes/line", "budget");
+    for (auto &path : paths)
+    {
+        double per_line = double(path.allocations) / path.lines;
+        printf("%-9s %9llu %12.3f %12.1f %8.3f%s\n", path.name, (unsigned long long) path.lines, per_line, double(path.bytes) / path.lines, path.budget, per_line > path.budget ? "  OVER" : "");
+        failed |= per_line > path.budget;
+    }
+    for (auto &path : paths)
+    {
+        if (double(path.allocations) / path.lines <= path.budget)
+            continue;
+        printf("\n%s allocated here:\n", path.name);
+        for (int i = 0; i < path.traces; i++)
+        {
+            printf("  #%d\n", i);
+            fflush(stdout);
+            // Skips countAllocation() and the allocator itself
+            backtrace_symbols_fd(path.frames[i] + 2, std::max(0, path.sizes[i] - 2), STDOUT_FILENO);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,234 @@
+#include "BlobTransfer.hpp"
+#include <algorithm>
+#include <iostream>
+
+static constexpr char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void encodeBase64(std::string_view in, std::string &out)
+{
+    out.clear();
+    out.reserve((in.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3)
+    {
+        uint32_t n = uint8_t(in[i]) << 16 | uint8_t(in[i + 1]) << 8 | uint8_t(in[i + 2]);
+        out += base64_chars[n >> 18];
+        out += base64_chars[n >> 12 & 63];
+        out += base64_chars[n >> 6 & 63];
+        out += base64_chars[n & 63];
+    }
+    if (i < in.size())
+    {
+        uint32_t n = uint8_t(in[i]) << 16;
+        if (i + 1 < in.size())
+            n |= uint8_t(in[i + 1]) << 8;
+        out += base64_chars[n >> 18];
+        out += base64_chars[n >> 12 & 63];
+        out += i + 1 < in.size() ? base64_chars[n >> 6 & 63] : '=';
+        out += '=';
+    }
+}
+
+static int base64Value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+static bool decodeBase64(std::string_view in, std::string &out)
+{
+    if (in.size() % 4)
+        return false;
+    out.clear();
+    out.reserve(in.size() / 4 * 3);
+    for (size_t i = 0; i < in.size(); i += 4)
+    {
+        uint32_t n  = 0;
+        int padding = 0;
+        for (size_t j = 0; j < 4; j++)
+        {
+            // Padding only at the end of the last group
+            if (in[i + j] == '=' && i + 4 == in.size() && j >= 2)
+            {
+                padding++;
+                n <<= 6;
+                continue;
+            }
+            int value = base64Value(in[i + j]);
+            if (value < 0 || padding)
+                return false;
+            n = n << 6 | value;
+        }
+        out += char(n >> 16);
+        if (padding < 2)
+            out += char(n >> 8 & 255);
+        if (padding < 1)
+            out += char(n & 255);
+    }
+    return true;
+}
+
+void ChIRC::BlobSender::setRate(double chunks_per_second, unsigned max_burst)
+{
+    rate   = chunks_per_second;
+    burst  = std::max(1u, max_burst);
+    tokens = std::min(tokens, burst);
+}
+
+void ChIRC::BlobSender::refill(std::chrono::time_point<Timer::clock> now)
+{
+    if (refilled != std::chrono::time_point<Timer::clock>{})
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - refilled).count() * rate);
+    refilled = now;
+}
+
+int ChIRC::BlobSender::queueBlob(std::string_view data, size_t chunk, int target)
+{
+    chunk -= chunk % 4;
+    if (!chunk || data.empty())
+        return 0;
+    Outgoing out;
+    encodeBase64(data, out.encoded);
+    size_t count = std::max<size_t>(1, (out.encoded.size() + chunk - 1) / chunk);
+    if (count > blob_max_chunks)
+        return 0;
+    out.blob   = next_blob++;
+    out.target = target;
+    out.chunk  = chunk;
+    out.next   = 0;
+    out.count  = count;
+    queue.push_back(std::move(out));
+    return queue.back().blob;
+}
+
+void ChIRC::BlobSender::finish(std::chrono::time_point<Timer::clock> now)
+{
+    queue.front().finished = now;
+    sent_bytes += queue.front().encoded.size();
+    sent.push_back(std::move(queue.front()));
+    queue.pop_front();
+    while (!sent.empty() && (sent_bytes > blob_memory_limit || std::chrono::duration_cast<std::chrono::seconds>(now - sent.front().finished).count() >= blob_timeout))
+    {
+        sent_bytes -= sent.front().encoded.size();
+        sent.pop_front();
+    }
+}
+
+const ChIRC::BlobSender::Outgoing *ChIRC::BlobSender::find(int blob) const
+{
+    for (auto &i : sent)
+        if (i.blob == blob)
+            return &i;
+    // Partly sent, only chunks before next went out
+    if (!queue.empty() && queue.front().blob == blob)
+        return &queue.front();
+    return nullptr;
+}
+
+void ChIRC::BlobSender::resend(int blob, uint32_t seq)
+{
+    const Outgoing *out = find(blob);
+    if (!out || seq >= out->count || (!queue.empty() && out == &queue.front() && seq >= out->next) || resends.size() >= blob_max_chunks)
+        return;
+    // Several receivers may ask for the same chunk
+    if (std::find(resends.begin(), resends.end(), std::make_pair(blob, seq)) == resends.end())
+        resends.emplace_back(blob, seq);
+}
+
+std::chrono::time_point<Timer::clock> ChIRC::BlobSender::next() const
+{
+    if (empty())
+        return std::chrono::time_point<Timer::clock>::max();
+    if (tokens >= 1.0)
+        return std::max(refilled, held);
+    return std::max(held, refilled + std::chrono::duration_cast<Timer::clock::duration>(std::chrono::duration<double>((1.0 - tokens) / rate)));
+}
+
+void ChIRC::BlobAssembler::drop(std::map<std::pair<int, int>, Incoming>::iterator blob)
+{
+    bytes -= blob->second.bytes;
+    incoming.erase(blob);
+}
+
+bool ChIRC::BlobAssembler::add(int sender, int blob, uint32_t seq, uint32_t count, std::string_view chunk, std::chrono::time_point<Timer::clock> now, std::string &out)
+{
+    if (!count || count > blob_max_chunks || seq >= count)
+        return false;
+    auto key  = std::make_pair(sender, blob);
+    auto done = completed.find(key);
+    if (done != completed.end())
+    {
+        // Another chunk count is a sender reusing ids after a restart
+        if (done->second.first == count)
+            return false;
+        completed.erase(done);
+    }
+    auto found = incoming.find(key);
+    if (found == incoming.end())
+    {
+        size_t table = count * sizeof(std::string);
+        if (bytes + table > blob_memory_limit)
+        {
+            std::cout << "ChIRC: No memory left for blob " << blob << " from " << sender << std::endl;
+            return false;
+        }
+        found = incoming.emplace(key, Incoming{}).first;
+        found->second.chunks.resize(count);
+        found->second.bytes = table;
+        bytes += table;
+    }
+    Incoming &in = found->second;
+    // A resent chunk or a sender reusing ids after a restart
+    if (in.chunks.size() != count || !in.chunks[seq].empty())
+    {
+        if (in.chunks.size() != count)
+            drop(found);
+        return false;
+    }
+    std::string &data = in.chunks[seq];
+    if (!decodeBase64(chunk, data) || data.empty() || bytes + data.size() > blob_memory_limit)
+    {
+        std::cout << "ChIRC: Dropped blob " << blob << " from " << sender << std::endl;
+        drop(found);
+        return false;
+    }
+    in.bytes += data.size();
+    bytes += data.size();
+    in.last = now;
+    if (++in.received != count)
+        return false;
+
+    out.clear();
+    out.reserve(in.bytes);
+    for (auto &i : in.chunks)
+        out += i;
+    drop(found);
+    completed[key] = std::make_pair(count, now);
+    return true;
+}
+
+void ChIRC::BlobAssembler::expire(std::chrono::time_point<Timer::clock> now)
+{
+    for (auto i = incoming.begin(); i != incoming.end();)
+    {
+        auto blob = i++;
+        if (std::chrono::duration_cast<std::chrono::seconds>(now - blob->second.last).count() >= blob_timeout)
+            drop(blob);
+    }
+    for (auto i = completed.begin(); i != completed.end();)
+    {
+        if (std::chrono::duration_cast<std::chrono::seconds>(now - i->second.second).count() >= blob_timeout)
+            i = completed.erase(i);
+        else
+            ++i;
+    }
+}
@@ -0,0 +1,190 @@
+#ifndef CH_BLOBTRANSFER_HPP
+#define CH_BLOBTRANSFER_HPP
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "timer.hpp"
+
+namespace ChIRC
+{
+// Most memory all blobs being reassembled may take together, in bytes
+constexpr size_t blob_memory_limit = 1 << 20;
+// Most chunks a single blob may be cut into
+constexpr uint32_t blob_max_chunks = 8192;
+// Seconds an incomplete blob is kept after its last chunk
+constexpr int blob_timeout = 30;
+// Milliseconds to hold chunks back after the connection refused one
+constexpr int blob_retry = 100;
+// Default pace of chunks, per second and in a burst. Servers allow about
+// one line a second once a client used up a burst of around five: ratbox
+// and Solanum add fake lag past that and InspIRCd's default commandrate is
+// one command a second. Heartbeats and auths only need a line every few
+// seconds, so blobs take most of the burst and the sustained rate, and
+// ChIRC holds them back while our send queue has a backlog. Faster is
+// only possible on servers that give us a higher limit, see setRate().
+constexpr double blob_rate    = 1.0;
+constexpr unsigned blob_burst = 4;
+// Seconds a blob has to stay incomplete before its missing chunks are
+// asked for, and how many times that is tried before giving up on it
+constexpr int blob_resend_after    = 3;
+constexpr int blob_resend_attempts = 3;
+// Most chunk numbers asked for at once
+constexpr size_t blob_resend_batch = 32;
+
+// Blobs waiting to be sent, cut into base64 chunks. A token bucket paces
+// the chunks so bulk transfers stay within the server's flood limits.
+// Blobs sent in full are kept for blob_timeout seconds, within
+// blob_memory_limit, so chunks a receiver missed can be sent again.
+class BlobSender
+{
+    struct Outgoing
+    {
+        int blob;
+        // Client the blob is meant for, 0 for everyone
+        int target;
+        std::string encoded;
+        // base64 characters per chunk, a multiple of 4
+        size_t chunk;
+        uint32_t next;
+        uint32_t count;
+        // When the last chunk went out, for blobs in sent
+        std::chrono::time_point<Timer::clock> finished{};
+
+        std::string_view chunkAt(uint32_t seq) const
+        {
+            return std::string_view(encoded).substr(seq * chunk, chunk);
+        }
+    };
+    std::deque<Outgoing> queue;
+    std::deque<Outgoing> sent;
+    size_t sent_bytes{ 0 };
+    // Chunks asked for again by blob id, sent before new ones
+    std::deque<std::pair<int, uint32_t>> resends;
+    int next_blob{ 1 };
+
+    // Chunks per second and most chunks sent in a burst
+    double rate{ blob_rate };
+    double burst{ blob_burst };
+    double tokens{ blob_burst };
+    std::chrono::time_point<Timer::clock> refilled{};
+    std::chrono::time_point<Timer::clock> held{};
+
+    void refill(std::chrono::time_point<Timer::clock> now);
+    // Moves the blob at the front of queue to sent and forgets old ones
+    void finish(std::chrono::time_point<Timer::clock> now);
+    const Outgoing *find(int blob) const;
+
+public:
+    void setRate(double chunks_per_second, unsigned max_burst);
+    // Queues data to be sent in chunks of up to chunk base64 characters.
+    // Returns the blob id, 0 if data is empty or needs more than
+    // blob_max_chunks.
+    int queueBlob(std::string_view data, size_t chunk, int target = 0);
+    // Sends chunk seq of blob again if it went out already and the blob
+    // was not forgotten yet
+    void resend(int blob, uint32_t seq);
+    bool empty() const
+    {
+        return queue.empty() && resends.empty();
+    }
+    // When the next chunk may go out
+    std::chrono::time_point<Timer::clock> next() const;
+
+    // Calls send(blob, target, seq, count, chunk) for every chunk the bucket
+    // allows right now. A send returning false keeps its token and holds the
+    // chunks back for blob_retry ms.
+    template <typename F> void pump(std::chrono::time_point<Timer::clock> now, F &&send)
+    {
+        refill(now);
+        if (now < held)
+            return;
+        while (!resends.empty() && tokens >= 1.0)
+        {
+            const Outgoing *out = find(resends.front().first);
+            uint32_t seq        = resends.front().second;
+            if (out && !send(out->blob, out->target, seq, out->count, out->chunkAt(seq)))
+            {
+                held = now + std::chrono::milliseconds(blob_retry);
+                return;
+            }
+            if (out)
+                tokens -= 1.0;
+            resends.pop_front();
+        }
+        while (!queue.empty() && tokens >= 1.0)
+        {
+            Outgoing &out = queue.front();
+            if (!send(out.blob, out.target, out.next, out.count, out.chunkAt(out.next)))
+            {
+                held = now + std::chrono::milliseconds(blob_retry);
+                return;
+            }
+            tokens -= 1.0;
+            if (++out.next == out.count)
+                finish(now);
+        }
+    }
+};
+
+// Chunks of blobs from other clients, reassembled within blob_memory_limit
+class BlobAssembler
+{
+    struct Incoming
+    {
+        std::vector<std::string> chunks;
+        uint32_t received{ 0 };
+        size_t bytes{ 0 };
+        std::chrono::time_point<Timer::clock> last{};
+        // When missing chunks were last asked for and how often
+        std::chrono::time_point<Timer::clock> requested{};
+        int attempts{ 0 };
+    };
+    // By sender id and blob id
+    std::map<std::pair<int, int>, Incoming> incoming;
+    size_t bytes{ 0 };
+    // Chunk count and completion time of blobs completed in the last
+    // blob_timeout seconds. Chunks resent for other receivers are ignored
+    // instead of starting the blob over.
+    std::map<std::pair<int, int>, std::pair<uint32_t, std::chrono::time_point<Timer::clock>>> completed;
+
+    void drop(std::map<std::pair<int, int>, Incoming>::iterator blob);
+
+public:
+    // Adds one chunk. Returns true with the data in out once the blob is
+    // complete.
+    bool add(int sender, int blob, uint32_t seq, uint32_t count, std::string_view chunk, std::chrono::time_point<Timer::clock> now, std::string &out);
+    // Drops blobs that stopped receiving chunks and forgets completed ones
+    void expire(std::chrono::time_point<Timer::clock> now);
+    // Calls request(sender, blob, seqs) with up to blob_resend_batch missing
+    // chunk numbers of every blob that got nothing new for
+    // blob_resend_after seconds
+    template <typename F> void requestMissing(std::chrono::time_point<Timer::clock> now, F &&request)
+    {
+        std::vector<uint32_t> seqs;
+        for (auto &i : incoming)
+        {
+            Incoming &in = i.second;
+            auto quiet   = std::chrono::seconds(blob_resend_after);
+            if (in.attempts == blob_resend_attempts || now - in.last < quiet || now - in.requested < quiet)
+                continue;
+            seqs.clear();
+            for (uint32_t seq = 0; seq < in.chunks.size() && seqs.size() < blob_resend_batch; seq++)
+                if (in.chunks[seq].empty())
+                    seqs.push_back(seq);
+            in.requested = now;
+            in.attempts++;
+            request(i.first.first, i.first.second, seqs);
+        }
+    }
+    size_t memory() const
+    {
+        return bytes;
+    }
+};
+} // namespace ChIRC
+#endif
@@ -1,5 +1,7 @@
 ﻿#include "ChIRC.hpp"
 #include <algorithm>
+#include <charconv>
+#include <climits>
 #include <random>
 #include "../ucccccp/ucccccp.hpp"
 #include "timer.hpp"
@@ -7,173 +9,767 @@
 constexpr std::string_view heartbeat = "cc_hb";
 constexpr std::string_view reqauth   = "cc_reqauth";
 constexpr std::string_view auth      = "cc_auth";
+// Asks the sender of a blob for chunks we missed
+constexpr std::string_view blob_resend = "cc_resend";
+// Sent to the comms channel, not the C&C one
+constexpr std::string_view blob_chunk = "cc_blob";
 
-void ChIRC::ChIRC::basicHandler(IRCMessage msg, IRCClient *irc, void *context)
+// Seconds without heartbeat until a peer is timed out
+constexpr int peer_timeout = 10;
+// Seconds a timed out peer is remembered for
+constexpr int dormant_timeout = 600;
+// Milliseconds we wait for QUIT and pending sends to go out on shutdown
+constexpr int quit_timeout = 2000;
+// Most ids asked for in a single reqauth
+constexpr size_t reqauth_batch = 32;
+// Most reqauth records sent per tick, only reached when bootstrapping from
+// a large NAMES list
+constexpr size_t reqauth_records = 4;
+// Most milliseconds we wait before answering a reqauth, so everyone asked
+// by one request does not answer at the same instant
+constexpr int auth_jitter = 250;
+// Longest wait between two reqauths for the same id, in seconds
+constexpr int reqauth_max_backoff = 30;
+// peer_caps bits we announce in our auth
+constexpr unsigned local_caps = ChIRC::cap_packed;
+// Separates records packed into one C&C message. Records never contain it,
+// so a single record is a packed message of one.
+constexpr char record_separator = ';';
+// Room left in a line for the ":nick!user@host " prefix the server adds when
+// relaying it
+constexpr size_t relay_prefix = 128;
+// Blob chunks wait while more than this many bytes are queued on the socket
+constexpr size_t blob_send_backlog = 2048;
+// Chat lines handled per IRC_OVERLOAD_TICK ms before a flood is shed, and
+// every how many shed lines one is handled anyway
+constexpr unsigned chat_budget = 200;
+constexpr unsigned chat_sample = 16;
+// Most C&C records held back for open batches, later ones are handled right
+// away
+constexpr size_t batch_max_records = 1024;
+
+template <typename T> static bool readField(std::string_view record, size_t &pos, T &out)
+{
+    if (pos == std::string_view::npos)
+        return false;
+    char const *begin = record.data() + pos + 1;
+    char const *end   = record.data() + record.size();
+    auto result       = std::from_chars(begin, end, out);
+    if (result.ec != std::errc())
+        return false;
+    pos = result.ptr != end && *result.ptr == '$' ? result.ptr - record.data() : std::string_view::npos;
+    return true;
+}
+
+// Reads the '$' separated numeric fields following the record name. Trailing
+// fields are ignored so newer clients can append to a record.
+template <typename... T> static bool readRecord(std::string_view record, T &... fields)
+{
+    size_t pos = record.find('$');
+    return (readField(record, pos, fields) && ...);
+}
+
+static bool isRecord(std::string_view rawmsg, std::string_view name)
+{
+    return rawmsg.compare(0, name.size(), name) == 0;
+}
+
+// f(record) for every record of a packed message
+template <typename F> static void forEachRecord(std::string_view records, F &&f)
+{
+    while (!records.empty())
+    {
+        size_t end = records.find(record_separator);
+        f(records.substr(0, end));
+        if (end == std::string_view::npos)
+            break;
+        records.remove_prefix(end + 1);
+    }
+}
+
+void ChIRC::ChIRC::basicHandler(IRCEvent const &event, IRCMessage const &msg, IRCClient *irc, void *context)
 {
     ChIRC *this_ChIRC = static_cast<ChIRC *>(context);
     if (!this_ChIRC)
         return;
-    if (msg.parameters.empty())
+    auto &callbacks = this_ChIRC->callbacks;
+    for (auto &i : callbacks)
+    {
+        if (std::string_view(msg.command) == i.first)
+        {
+            i.second(msg, irc);
+        }
+    }
+
+    // Registered, after CAP negotiation and any alternate nicks. A JOIN sent
+    // before this is refused.
+    IRCNumericEvent const *numeric = std::get_if<IRCNumericEvent>(&event);
+    if (numeric && numeric->code == 1)
+    {
+        std::lock_guard<std::mutex> lock(this_ChIRC->data_lock);
+        this_ChIRC->registered_nick = irc->GetNick();
+        this_ChIRC->joinChannels(true, true);
+        return;
+    }
+
+    // Peers keep their id across nick changes
+    IRCNickEvent const *nick = std::get_if<IRCNickEvent>(&event);
+    if (nick && nick->newNick == irc->GetNick())
+    {
+        std::lock_guard<std::mutex> lock(this_ChIRC->data_lock);
+        this_ChIRC->registered_nick = irc->GetNick();
         return;
-    try
+    }
+    if (nick)
     {
-        msg.parameters.at(0);
-        msg.parameters.at(1);
+        this_ChIRC->renamePeer(nick->nick, nick->newNick);
+        return;
     }
-    catch (std::out_of_range)
+
+    // The server confirmed our JOIN, only now do C&C records reach anyone
+    IRCJoinEvent const *join = std::get_if<IRCJoinEvent>(&event);
+    if (join && join->nick == irc->GetNick())
     {
+        std::lock_guard<std::mutex> lock(this_ChIRC->data_lock);
+        if (join->channel == this_ChIRC->data.commandandcontrol_channel)
+            this_ChIRC->data.is_commandandcontrol = true;
         return;
     }
-    auto &callbacks = this_ChIRC->callbacks;
-    for (auto &i : callbacks)
+
+    // Everyone already in the C&C channel when we join
+    IRCNamesEvent const *names = std::get_if<IRCNamesEvent>(&event);
+    if (names && this_ChIRC->isCommandChannel(names->channel))
+    {
+        this_ChIRC->learnNames(names->names);
+        return;
+    }
+
+    IRCBatchEvent const *batch = std::get_if<IRCBatchEvent>(&event);
+    if (batch)
     {
-        if (msg.command == i.first)
+        this_ChIRC->handleBatch(*batch);
+        return;
+    }
+
+    IRCPrivMsgEvent const *privmsg = std::get_if<IRCPrivMsgEvent>(&event);
+    if (!privmsg || privmsg->isCtcp)
+        return;
+    std::string &payload = this_ChIRC->payload;
+    payload.assign(privmsg->text);
+    if (!ucccccp::validate(payload))
+        return;
+    payload = ucccccp::decrypt(payload);
+    // With server-time the record counts as received when the server
+    // relayed it, so time spent in our own receive backlog is not blamed on
+    // the sender. The offset between the server's clock and ours is
+    // constant and drops out against the latency baseline.
+    auto received = PeerLatency::clock::now();
+    std::chrono::system_clock::time_point relayed;
+    if (msg.tags.ServerTime(relayed))
+        received -= std::chrono::duration_cast<PeerLatency::clock::duration>(std::chrono::system_clock::now() - relayed);
+    // Our own message back from the server, only proof it was delivered
+    if (privmsg->isEcho)
+    {
+        if (this_ChIRC->isCommandChannel(privmsg->target))
+            forEachRecord(payload, [&](std::string_view record) { this_ChIRC->handleEcho(record, received); });
+        return;
+    }
+    if (isRecord(payload, blob_chunk) && this_ChIRC->isCommsChannel(privmsg->target))
+    {
+        this_ChIRC->handleBlobChunk(payload);
+        return;
+    }
+    if (!this_ChIRC->isCommandChannel(privmsg->target))
+        return;
+    std::string_view reference;
+    auto &batched = this_ChIRC->batched_records;
+    if (msg.tags.Get("batch", reference) && this_ChIRC->open_batches.count(std::string(reference)) && batched.size() < batch_max_records)
+    {
+        forEachRecord(payload, [&](std::string_view record) { batched.push_back(BatchedRecord{ std::string(reference), std::string(record), std::string(privmsg->nick), received }); });
+        return;
+    }
+    forEachRecord(payload, [&](std::string_view record) { this_ChIRC->handleCommand(record, privmsg->nick, received); });
+}
+
+void ChIRC::ChIRC::handleBatch(IRCBatchEvent const &batch)
+{
+    std::string reference(batch.reference);
+    if (batch.start)
+    {
+        open_batches[reference] = std::string(batch.type);
+        return;
+    }
+    auto found = open_batches.find(reference);
+    if (found == open_batches.end())
+        return;
+    // History played back on join is not what peers are doing now
+    bool replay = found->second == "chathistory";
+    open_batches.erase(found);
+    auto end = std::stable_partition(batched_records.begin(), batched_records.end(), [&](const BatchedRecord &i) { return i.batch != reference; });
+    if (!replay)
+        for (auto i = end; i != batched_records.end(); ++i)
+            handleCommand(i->record, i->nick, i->received);
+    batched_records.erase(end, batched_records.end());
+}
+
+void ChIRC::ChIRC::handleCommand(std::string_view rawmsg, std::string_view nick, PeerLatency::clock::time_point received)
+{
+    if (isRecord(rawmsg, heartbeat))
+    {
+        int id         = 0;
+        int party_size = 0;
+        int is_ingame  = 0;
+        uint32_t seq   = 0;
+        uint64_t sent  = 0;
+        // Older clients send no sequence number and timestamp
+        bool stamped = readRecord(rawmsg, id, party_size, is_ingame, seq, sent);
+        if (!stamped && !readRecord(rawmsg, id, party_size, is_ingame))
         {
-            i.second(msg, irc);
+            std::cout << "ChIRC: Recieved invalid heartbeat" << std::endl;
+            return;
+        }
+
+        auto now = Timer::clock::now();
+        std::lock_guard<std::mutex> lock(peers_lock);
+        uint32_t row = peers.find(id);
+        if (row != PeerTable::npos)
+        {
+            if (peers.party_size(row) != party_size || peers.is_ingame(row) != bool(is_ingame))
+                notePeerChange(id, peer_state_changed);
+            peers.update(id, now, party_size, is_ingame);
+            if (stamped)
+                peer_latency[id].add(seq, sent, received);
+            return;
+        }
+        // Known from before a reconnect or restart, revalidated by this
+        // heartbeat. Ids are random and another client may have picked the
+        // same one, so only the nick it authed with brings it back.
+        auto dormant = dormant_peers.find(id);
+        if (dormant != dormant_peers.end() && dormant->second.nickname == nick)
+        {
+            dormant->second.heartbeat  = now;
+            dormant->second.party_size = party_size;
+            dormant->second.is_ingame  = is_ingame;
+            insertPeer(id, dormant->second);
+            dormant_peers.erase(dormant);
+            notePeerChange(id, peer_added);
+            if (stamped)
+                peer_latency[id].add(seq, sent, received);
+        }
+        else
+        {
+            if (dormant != dormant_peers.end())
+                dormant_peers.erase(dormant);
+            // Not found in peers. Ask for auth with the next batch.
+            auto pending = pending_auth.emplace(id, PendingAuth{ now, now, 0 }).first;
+            pending->second.last_seen = now;
         }
     }
-    if (msg.command == "PRIVMSG")
+    else if (isRecord(rawmsg, auth))
     {
-        std::string rawmsg   = msg.parameters.at(1);
-        std::string &channel = msg.parameters.at(0);
-        if (!ucccccp::validate(rawmsg))
+        int id               = 0;
+        int is_bot           = 0;
+        unsigned int steamid = 0;
+        unsigned caps        = 0;
+        uint32_t address     = 0;
+        uint16_t port        = 0;
+        uint64_t token       = 0;
+        // Older clients stop after the steamid or the capabilities, the
+        // endpoint and its token are only there with cap_direct
+        if (!readRecord(rawmsg, id, is_bot, steamid, caps, address, port, token) && !readRecord(rawmsg, id, is_bot, steamid, caps) && !readRecord(rawmsg, id, is_bot, steamid))
+        {
+            std::cout << "ChIRC: Recieved invalid auth" << std::endl;
             return;
-        rawmsg = ucccccp::decrypt(rawmsg);
-        if (channel == this_ChIRC->data.commandandcontrol_channel && this_ChIRC->data.is_commandandcontrol)
+        }
+        std::lock_guard<std::mutex> lock(peers_lock);
+        PeerData peer         = {};
+        peer.heartbeat        = Timer::clock::now();
+        peer.is_bot           = is_bot;
+        peer.nickname         = nick;
+        peer.steamid          = steamid;
+        peer.caps             = caps;
+        uint32_t row          = peers.find(id);
+        if (row == PeerTable::npos)
+            notePeerChange(id, peer_added | peer_authenticated);
+        else if (peers.party_size(row) != peer.party_size || peers.is_ingame(row) != peer.is_ingame)
+            notePeerChange(id, peer_authenticated | peer_state_changed);
+        else
+            notePeerChange(id, peer_authenticated);
+        insertPeer(id, peer);
+        dormant_peers.erase(id);
+        pending_auth.erase(id);
+        if (caps & cap_direct && port && token)
+            direct_endpoints[id] = DirectEndpoint{ address, port, token };
+        else
+            direct_endpoints.erase(id);
+    }
+    else if (isRecord(rawmsg, reqauth))
+    {
+        // cc_reqauth$id[$id...], answered once per rate limit period in
+        // Update() no matter how many peers asked
+        size_t pos = rawmsg.find('$');
+        int id     = 0;
+        while (readField(rawmsg, pos, id))
         {
-            if (rawmsg.find(heartbeat.data()) == 0)
+            if (id == data.id)
             {
-                int id                = 0;
-                int party_size        = 0;
-                bool is_ingame        = false;
-                size_t id_loc         = rawmsg.find('$') + 1;
-                size_t party_size_loc = rawmsg.find('$', id_loc) + 1;
-                size_t ingame_loc     = rawmsg.find('$', party_size_loc) + 1;
-                try
-                {
-                    id         = std::stoi(rawmsg.substr(id_loc, party_size_loc - id_loc));
-                    party_size = std::stoi(rawmsg.substr(party_size_loc, ingame_loc - party_size_loc));
-                    is_ingame  = std::stoi(rawmsg.substr(ingame_loc));
-                }
-                catch (std::invalid_argument)
-                {
-                    std::cout << "ChIRC: Recieved invalid heartbeat" << std::endl;
-                    return;
-                }
-
-                std::lock_guard<std::mutex> lock(this_ChIRC->peers_lock);
-                if (this_ChIRC->peers.find(id) == this_ChIRC->peers.end())
-                {
-                    // Not found in peers. Ask for auth.
-                    this_ChIRC->privmsg(std::string(reqauth) + '$' + std::to_string(id), true);
-                }
-                else
-                {
-                    // Found in peers. Update peer.
-                    auto &peer      = this_ChIRC->peers[id];
-                    peer.heartbeat  = std::chrono::system_clock::now();
-                    peer.party_size = party_size;
-                    peer.is_ingame  = is_ingame;
-                }
+                auth_requested = true;
+                return;
             }
-            else if (rawmsg.find(auth.data()) == 0)
-            {
-                int id               = 0;
-                bool is_bot          = false;
-                unsigned int steamid = 0;
-                size_t id_loc        = rawmsg.find('$') + 1;
-                size_t is_bot_loc    = rawmsg.find('$', id_loc) + 1;
-                size_t steamid_loc   = rawmsg.find('$', is_bot_loc) + 1;
-
-                try
-                {
-                    id      = std::stoi(rawmsg.substr(id_loc, is_bot_loc - id_loc));
-                    is_bot  = std::stoi(rawmsg.substr(is_bot_loc, steamid_loc - is_bot_loc));
-                    steamid = std::stoi(rawmsg.substr(steamid_loc));
-                }
-                catch (std::invalid_argument)
-                {
-                    std::cout << "ChIRC: Recieved invalid auth" << std::endl;
-                    return;
-                }
-                std::lock_guard<std::mutex> lock(this_ChIRC->peers_lock);
-                PeerData peer         = {};
-                peer.heartbeat        = std::chrono::system_clock::now();
-                peer.is_bot           = is_bot;
-                peer.nickname         = msg.prefix.nick;
-                peer.steamid          = steamid;
-                this_ChIRC->peers[id] = std::move(peer);
-            }
-            else if (rawmsg.find(reqauth.data()) == 0)
+        }
+        if (!id)
+            std::cout << "ChIRC: Recieved invalid reqauth" << std::endl;
+    }
+    else if (isRecord(rawmsg, blob_resend))
+    {
+        // cc_resend$sender$blob$seq[$seq...], handed to the sender in
+        // deliverBlobs()
+        size_t pos   = rawmsg.find('$');
+        int sender   = 0;
+        int blob     = 0;
+        uint32_t seq = 0;
+        if (!readField(rawmsg, pos, sender) || !readField(rawmsg, pos, blob) || sender != data.id)
+            return;
+        std::lock_guard<std::mutex> lock(blobs_lock);
+        while (readField(rawmsg, pos, seq))
+            blob_resends.emplace_back(blob, seq);
+        blobs_pending = true;
+    }
+}
+
+void ChIRC::ChIRC::handleEcho(std::string_view rawmsg, PeerLatency::clock::time_point received)
+{
+    int id         = 0;
+    int party_size = 0;
+    int is_ingame  = 0;
+    uint32_t seq   = 0;
+    uint64_t sent  = 0;
+    if (!isRecord(rawmsg, heartbeat) || !readRecord(rawmsg, id, party_size, is_ingame, seq, sent))
+        return;
+    std::lock_guard<std::mutex> lock(peers_lock);
+    echo_latency.add(seq, sent, received);
+}
+
+void ChIRC::ChIRC::sendHeartbeat()
+{
+    GameState state = game_state;
+    char record[IRC_MAX_LINE];
+    size_t length = IRCFormat::Write(record, sizeof(record), heartbeat, '$', data.id, '$', state.party_size, '$', state.is_ingame, '$', ++heartbeat_seq, '$', PeerLatency::stamp(PeerLatency::clock::now()));
+    queueRecord(std::string_view(record, length));
+}
+
+void ChIRC::ChIRC::sendAuthRequests()
+{
+    auto now = timers.now();
+    std::vector<std::pair<std::chrono::time_point<Timer::clock>, int>> due;
+    {
+        std::lock_guard<std::mutex> lock(peers_lock);
+        for (auto i = pending_auth.begin(); i != pending_auth.end();)
+        {
+            // Stopped sending heartbeats, not worth asking anymore
+            if (std::chrono::duration_cast<std::chrono::seconds>(now - i->second.last_seen).count() >= peer_timeout)
+                i = pending_auth.erase(i);
+            else
             {
-                int id        = 0;
-                size_t id_loc = rawmsg.find('$') + 1;
-                try
-                {
-                    id = std::stoi(rawmsg.substr(id_loc));
-                }
-                catch (std::invalid_argument)
-                {
-                    std::cout << "ChIRC: Recieved invalid reqauth" << std::endl;
-                    return;
-                }
-                static Timer last_req_auth{};
-                if (last_req_auth.test_and_set(1000) && id == this_ChIRC->data.id)
-                {
-                    this_ChIRC->sendAuth();
-                }
+                if (i->second.next <= now)
+                    due.emplace_back(i->second.first_seen, i->first);
+                ++i;
             }
         }
+        // Oldest first, older clients only read the first id of a batch
+        std::sort(due.begin(), due.end());
+        if (due.size() > reqauth_batch * reqauth_records)
+            due.resize(reqauth_batch * reqauth_records);
+        for (auto &i : due)
+        {
+            PendingAuth &pending = pending_auth[i.second];
+            int backoff          = std::min(1 << std::min(pending.attempts, 5), reqauth_max_backoff);
+            pending.next         = now + std::chrono::seconds(backoff);
+            pending.attempts++;
+        }
+    }
+    for (size_t first = 0; first < due.size(); first += reqauth_batch)
+    {
+        char record[IRC_MAX_LINE];
+        size_t length = IRCFormat::Write(record, sizeof(record), reqauth);
+        for (size_t i = first; i < std::min(first + reqauth_batch, due.size()); i++)
+            length += IRCFormat::Write(record + length, sizeof(record) - length, '$', due[i].second);
+        queueRecord(std::string_view(record, length));
     }
 }
 
-void ChIRC::ChIRC::sendHeartbeat()
+void ChIRC::ChIRC::learnNames(std::string_view names)
 {
-    std::string output = std::string(heartbeat) + '$' + std::to_string(data.id) + "$" + std::to_string(game_state.load().party_size) + "$" + std::to_string(game_state.load().is_ingame);
-    privmsg(output, true);
+    auto now     = Timer::clock::now();
+    bool learned = false;
+    std::lock_guard<std::mutex> lock(peers_lock);
+    while (!names.empty())
+    {
+        size_t end            = names.find(' ');
+        std::string_view name = names.substr(0, end);
+        names.remove_prefix(end == std::string_view::npos ? names.size() : end + 1);
+        // Channel mode prefixes
+        while (!name.empty() && std::string_view("@+%&~").find(name.front()) != std::string_view::npos)
+            name.remove_prefix(1);
+        // Our nicknames end in -id
+        size_t dash = name.rfind('-');
+        int id      = 0;
+        if (dash == std::string_view::npos || std::from_chars(name.data() + dash + 1, name.data() + name.size(), id).ptr != name.data() + name.size() || id <= 0)
+            continue;
+        if (id == data.id || peers.find(id) != PeerTable::npos)
+            continue;
+        // Being in the channel under the same nick is as good as a
+        // heartbeat, someone else with that id has to auth
+        auto dormant = dormant_peers.find(id);
+        if (dormant != dormant_peers.end() && dormant->second.nickname == name)
+        {
+            dormant->second.heartbeat = now;
+            insertPeer(id, dormant->second);
+            dormant_peers.erase(dormant);
+            notePeerChange(id, peer_added);
+            continue;
+        }
+        if (dormant != dormant_peers.end())
+            dormant_peers.erase(dormant);
+        auto pending = pending_auth.emplace(id, PendingAuth{ now, now, 0, now }).first;
+        pending->second.last_seen = now;
+        pending->second.next      = now;
+        learned                   = true;
+    }
+    if (learned)
+        bootstrap_pending = true;
+    // Members learn about us from our auth instead of waiting to ask
+    auth_requested = true;
 }
 
 void ChIRC::ChIRC::sendAuth()
 {
-    std::string output = std::string(auth) + '$' + std::to_string(data.id) + '$' + std::to_string(data.is_bot) + '$' + std::to_string(data.steamid);
-    privmsg(output, true);
+    char record[IRC_MAX_LINE];
+    size_t length;
+    if (direct.isOpen())
+        length = IRCFormat::Write(record, sizeof(record), auth, '$', data.id, '$', data.is_bot, '$', data.steamid, '$', local_caps | cap_direct, '$', direct.endpoint().address, '$', direct.endpoint().port, '$', direct.endpoint().token);
+    else
+        length = IRCFormat::Write(record, sizeof(record), auth, '$', data.id, '$', data.is_bot, '$', data.steamid, '$', local_caps);
+    queueRecord(std::string_view(record, length));
+}
+
+size_t ChIRC::ChIRC::blobChunkSize()
+{
+    size_t budget = IRC_MAX_LINE - 2 - relay_prefix - (sizeof("PRIVMSG  :") - 1) - data.comms_channel.size();
+    char header[IRC_MAX_LINE];
+    size_t length = IRCFormat::Write(header, sizeof(header), blob_chunk, '$', INT_MIN, '$', INT_MIN, '$', UINT32_MAX, '$', UINT32_MAX, '$', INT_MIN, '$');
+    // Largest multiple of 4 whose encrypted record still fits
+    size_t low = 0, high = budget / 4;
+    while (low < high)
+    {
+        size_t mid = (low + high + 1) / 2;
+        if (ucccccp::encrypt(std::string(header, length) + std::string(mid * 4, 'A'), 'B').size() <= budget)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low * 4;
+}
+
+void ChIRC::ChIRC::sendBlobChunks(std::chrono::time_point<Timer::clock> now)
+{
+    blob_sender.pump(now, [this](int blob, int target, uint32_t seq, uint32_t count, std::string_view chunk) {
+        // Let heartbeats and everything else queued go out first
+        if (IRC.GetSendQueued() > blob_send_backlog)
+            return false;
+        char record[IRC_MAX_LINE];
+        size_t length = IRCFormat::Write(record, sizeof(record), blob_chunk, '$', data.id, '$', blob, '$', seq, '$', count, '$', target, '$', chunk);
+        return length && privmsg(std::string(record, length));
+    });
+}
+
+void ChIRC::ChIRC::handleBlobChunk(std::string_view record)
+{
+    // cc_blob$sender$blob$seq$count$target$base64
+    size_t pos     = record.find('$');
+    int sender     = 0;
+    int blob       = 0;
+    uint32_t seq   = 0;
+    uint32_t count = 0;
+    int target     = 0;
+    if (!readField(record, pos, sender) || !readField(record, pos, blob) || !readField(record, pos, seq) || !readField(record, pos, count) || !readField(record, pos, target) || pos == std::string_view::npos)
+    {
+        std::cout << "ChIRC: Recieved invalid blob chunk" << std::endl;
+        return;
+    }
+    // Meant for someone else
+    if (target && target != data.id)
+        return;
+    ReceivedBlob received{ sender, blob, {}, false };
+    std::lock_guard<std::mutex> lock(blobs_lock);
+    if (!blob_assembler.add(sender, blob, seq, count, record.substr(pos + 1), Timer::clock::now(), received.data))
+        return;
+    completed_blobs.push_back(std::move(received));
+    blobs_pending = true;
+}
+
+void ChIRC::ChIRC::requestMissingChunks(std::chrono::time_point<Timer::clock> now)
+{
+    std::lock_guard<std::mutex> lock(blobs_lock);
+    blob_assembler.expire(now);
+    blob_assembler.requestMissing(now, [this](int sender, int blob, const std::vector<uint32_t> &seqs) {
+        char record[IRC_MAX_LINE];
+        size_t length = IRCFormat::Write(record, sizeof(record), blob_resend, '$', sender, '$', blob);
+        for (uint32_t seq : seqs)
+            length += IRCFormat::Write(record + length, sizeof(record) - length, '$', seq);
+        queueRecord(std::string_view(record, length));
+    });
+}
+
+void ChIRC::ChIRC::deliverBlobs()
+{
+    std::vector<ReceivedBlob> blobs;
+    std::vector<std::pair<int, std::string>> fallback;
+    std::vector<std::pair<int, uint32_t>> resends;
+    {
+        std::lock_guard<std::mutex> lock(blobs_lock);
+        blobs_pending = false;
+        blobs.swap(completed_blobs);
+        fallback.swap(direct_fallback);
+        resends.swap(blob_resends);
+    }
+    for (auto &i : resends)
+        blob_sender.resend(i.first, i.second);
+    for (auto &i : fallback)
+        blob_sender.queueBlob(i.second, blobChunkSize(), i.first);
+    if (!blob_callback)
+        return;
+    for (auto &i : blobs)
+        blob_callback(i);
+}
+
+bool ChIRC::ChIRC::peersAllLocal()
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    if (peers.empty() || !pending_auth.empty())
+        return false;
+    bool local = true;
+    peers.forEach([&](uint32_t row) { local &= bus.isLocal(peers.id(row)); });
+    return local;
+}
+
+bool ChIRC::ChIRC::openBus()
+{
+    if (!data.id || data.commandandcontrol_channel.empty())
+        return false;
+    // One bus per server, C&C channel and key, so instances that could not
+    // join each other's channel do not share a bus either
+    uint32_t hash = 2166136261u;
+    for (char c : data.address + ':' + std::to_string(data.port) + data.commandandcontrol_channel + ' ' + data.commandandcontrol_password)
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    char name[32];
+    size_t length = IRCFormat::Write(name, sizeof(name), "/chirc-", hash);
+    auto receive  = [this](std::string_view record, std::string_view nickname) {
+        if (inCommandChannel())
+            handleCommand(record, nickname, PeerLatency::clock::now());
+    };
+    return bus.open(std::string(name, length), data.id, ircNick(), receive);
+}
+
+bool ChIRC::ChIRC::openDirect(const char *address, int port)
+{
+    if (!data.id)
+        return false;
+    auto receive = [this](int sender, std::string &&message) {
+        std::lock_guard<std::mutex> lock(blobs_lock);
+        completed_blobs.push_back(ReceivedBlob{ sender, 0, std::move(message), true });
+        blobs_pending = true;
+    };
+    auto undeliverable = [this](int peer, std::string &&message) {
+        std::lock_guard<std::mutex> lock(blobs_lock);
+        direct_fallback.emplace_back(peer, std::move(message));
+        blobs_pending = true;
+    };
+    // Only peers whose auth we saw on IRC get in, under the id they used there
+    auto verify = [this](int peer, uint64_t token) {
+        std::lock_guard<std::mutex> lock(peers_lock);
+        auto found = direct_endpoints.find(peer);
+        return found != direct_endpoints.end() && found->second.token == token;
+    };
+    if (!direct.open(data.id, address, port, receive, undeliverable, verify))
+        return false;
+    // Peers learn about the endpoint from our next auth
+    auth_requested = true;
+    return true;
+}
+
+bool ChIRC::ChIRC::sendToPeer(int id, std::string_view message)
+{
+    DirectEndpoint endpoint;
+    {
+        std::lock_guard<std::mutex> lock(peers_lock);
+        auto found = direct_endpoints.find(id);
+        if (found != direct_endpoints.end())
+            endpoint = found->second;
+    }
+    if (direct.send(id, endpoint, message))
+        return true;
+    return blob_sender.queueBlob(message, blobChunkSize(), id) != 0;
+}
+
+void ChIRC::ChIRC::queueRecord(std::string_view record)
+{
+    if (!outbox.empty())
+        outbox += record_separator;
+    outbox += record;
+}
+
+bool ChIRC::ChIRC::peersReadPacked()
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    // Unknown peers may be older clients
+    if (!pending_auth.empty())
+        return false;
+    bool packed = true;
+    peers.forEach([&](uint32_t row) { packed &= (peers.caps(row) & cap_packed) != 0; });
+    return packed;
+}
+
+void ChIRC::ChIRC::flushRecords()
+{
+    if (outbox.empty())
+        return;
+    std::string_view records = outbox;
+    if (bus.isOpen())
+    {
+        // Peers check our records against the nick they saw on IRC
+        bus.setNickname(ircNick());
+        forEachRecord(records, [this](std::string_view record) { bus.broadcast(record); });
+        // Everyone we know got them through the bus already
+        if (peersAllLocal())
+        {
+            outbox.clear();
+            return;
+        }
+    }
+    if (records.find(record_separator) == std::string_view::npos || !peersReadPacked())
+    {
+        forEachRecord(records, [this](std::string_view record) { privmsg(std::string(record), true); });
+        outbox.clear();
+        return;
+    }
+
+    size_t budget = IRC_MAX_LINE - 2 - relay_prefix - (sizeof("PRIVMSG  :") - 1) - data.commandandcontrol_channel.size();
+    std::string line;
+    // Grow each message by one record while its encrypted form still fits
+    size_t taken = 0;
+    while (!records.empty())
+    {
+        size_t end = records.find(record_separator, taken ? taken + 1 : 0);
+        if (end == std::string_view::npos)
+            end = records.size();
+        std::string encrypted = ucccccp::encrypt(std::string(records.substr(0, end)), 'B');
+        // A lone record goes out whatever its size, as it always has
+        if (encrypted.size() <= budget || !taken)
+        {
+            line  = std::move(encrypted);
+            taken = end;
+            if (end != records.size())
+                continue;
+        }
+        send("PRIVMSG ", data.commandandcontrol_channel, " :", line);
+        records.remove_prefix(std::min(taken + 1, records.size()));
+        taken = 0;
+    }
+    outbox.clear();
 }
 
 void ChIRC::ChIRC::IRCThread()
 {
-    if (!IRC.InitSocket() || !IRC.Connect(data.address.c_str(), data.port) || !IRC.Login(data.nick + '-' + std::to_string(data.id), data.user))
+    // Peers read our id from the end of the nick, so alternates number the
+    // part before it
+    IRC.SetAlternateNick([this](std::string const &, unsigned attempt) {
+        std::lock_guard<std::mutex> lock(data_lock);
+        return data.nick + std::to_string(attempt) + '-' + std::to_string(data.id);
+    });
+    // A flooded comms channel must not hold up PINGs and C&C traffic
+    IRC.SetChatBudget(chat_budget, chat_sample);
+    // Echoes of our heartbeats tell how long our records take to go out,
+    // only wanted if someone reads getEchoLatency()
+    IRC.SetCapabilities(IRC_CAP_SERVER_TIME | IRC_CAP_BATCH | (echo_wanted ? IRC_CAP_ECHO_MESSAGE : 0));
+    std::string nick, user, address;
+    int port;
+    {
+        std::lock_guard<std::mutex> lock(data_lock);
+        nick    = data.nick + '-' + std::to_string(data.id);
+        user    = data.user;
+        address = data.address;
+        port    = data.port;
+        // Not in any channel on a new connection
+        data.is_commandandcontrol = false;
+        registered_nick.clear();
+    }
+    if (!IRC.InitSocket() || !IRC.Connect(address.c_str(), port) || !IRC.Login(nick, user))
     {
         status = joining;
         return;
     }
     statusenum compare = initing;
     if (!status.compare_exchange_strong(compare, running))
+    {
+        IRC.Disconnect();
         return;
-    std::thread joinChannel([=]() {
-        std::this_thread::sleep_for(std::chrono_literals::operator""s(1));
-        if (this && IRC.Connected())
-        {
-            sendraw("JOIN " + data.comms_channel);
-            if (!data.commandandcontrol_channel.empty())
-            {
-                data.is_commandandcontrol = true;
-                sendraw("JOIN " + data.commandandcontrol_channel + " " + data.commandandcontrol_password);
-                sendraw("MODE " + data.commandandcontrol_channel + " +k " + data.commandandcontrol_password);
-                sendraw("MODE " + data.commandandcontrol_channel + " +s");
-                sendraw("MODE " + data.commandandcontrol_channel + " +n");
-            }
-            else
-                data.is_commandandcontrol = false;
-        }
-    });
-    joinChannel.detach();
+    }
+    connected_at = Timer::clock::now();
+    // Batches do not outlive the connection they were opened on
+    open_batches.clear();
+    batched_records.clear();
     while (IRC.Connected() && status == running)
     {
         IRC.ReceiveData();
     }
+    IRC.Quit("Leaving", quit_timeout);
     status.store(joining);
 }
 
+void ChIRC::ChIRC::joinChannels(bool comms, bool commandandcontrol)
+{
+    if (comms && !data.comms_channel.empty())
+        send("JOIN ", data.comms_channel);
+    if (!commandandcontrol)
+        return;
+    // Set again once the server echoes our JOIN
+    data.is_commandandcontrol = false;
+    IRC.SetPriorityTargets(!data.commandandcontrol_channel.empty() ? std::vector<std::string>{ data.commandandcontrol_channel } : std::vector<std::string>{});
+    if (data.commandandcontrol_channel.empty())
+        return;
+    send("JOIN ", data.commandandcontrol_channel, ' ', data.commandandcontrol_password);
+    if (!data.commandandcontrol_password.empty())
+        send("MODE ", data.commandandcontrol_channel, " +k ", data.commandandcontrol_password);
+    send("MODE ", data.commandandcontrol_channel, " +s");
+    send("MODE ", data.commandandcontrol_channel, " +n");
+}
+
+bool ChIRC::ChIRC::isCommsChannel(std::string_view channel)
+{
+    std::lock_guard<std::mutex> lock(data_lock);
+    return channel == data.comms_channel;
+}
+
+bool ChIRC::ChIRC::isCommandChannel(std::string_view channel)
+{
+    std::lock_guard<std::mutex> lock(data_lock);
+    return data.is_commandandcontrol && channel == data.commandandcontrol_channel;
+}
+
+bool ChIRC::ChIRC::inCommandChannel() const
+{
+    std::lock_guard<std::mutex> lock(data_lock);
+    return data.is_commandandcontrol;
+}
+
+std::string ChIRC::ChIRC::ircNick() const
+{
+    std::lock_guard<std::mutex> lock(data_lock);
+    // What we will try first until the server confirms a nick
+    return !registered_nick.empty() ? registered_nick : data.nick + '-' + std::to_string(data.id);
+}
+
 void ChIRC::ChIRC::ChangeState(bool state)
 {
     if (state)
@@ -184,13 +780,17 @@ void ChIRC::ChIRC::ChangeState(bool state)
             thread = std::thread(&ChIRC::IRCThread, this);
         }
     }
-    else
+    else if (status != off)
     {
-        status = stopping;
-        IRC.Disconnect();
+        auto start = Timer::clock::now();
+        status     = stopping;
+        // Wakes the IRC thread, it sends QUIT and leaves on its own
+        IRC.Interrupt();
         if (thread.joinable())
             thread.join();
+        IRC.Disconnect();
         status = off;
+        std::cout << "ChIRC: Stopped in " << std::chrono::duration_cast<std::chrono::milliseconds>(Timer::clock::now() - start).count() << "ms" << std::endl;
     }
 }
 
@@ -201,82 +801,408 @@ void ChIRC::ChIRC::updateID()
     std::uniform_int_distribution<int> dist{ 1, 10000 };
     data.id = dist(e);
 }
+bool ChIRC::ChIRC::setSnapshot(const char *path)
+{
+    if (status != off || !snapshot.open(path))
+        return false;
+    // Keep the id peers already know us by
+    if (snapshot.loadID())
+        data.id = snapshot.loadID();
+    std::lock_guard<std::mutex> lock(peers_lock);
+    snapshot.load(dormant_peers);
+    return true;
+}
+
 void ChIRC::ChIRC::UpdateData(std::string user, std::string nick, std::string comms_channel, std::string commandandcontrol_channel, std::string commandandcontrol_password, std::string address, int port, bool is_bot, unsigned int steamid)
 {
-    updateID();
+    // The id is kept across reconnects so peers do not need to auth us again
+    if (!data.id)
+        updateID();
 
     // Fix spaces
     std::replace(nick.begin(), nick.end(), ' ', '_');
     std::replace(nick.begin(), nick.end(), ' ', '_');
 
-    data.user = user;
-    data.nick = nick;
     if (!comms_channel.empty() && comms_channel.front() != '#')
         comms_channel = '#' + comms_channel;
-    data.comms_channel = comms_channel;
     if (!commandandcontrol_channel.empty() && commandandcontrol_channel.front() != '#')
         commandandcontrol_channel = '#' + commandandcontrol_channel;
-    data.commandandcontrol_channel  = commandandcontrol_channel;
-    data.commandandcontrol_password = commandandcontrol_password;
-    data.address                    = address;
-    data.port                       = port;
-    data.is_bot                     = is_bot;
-    data.steamid                    = steamid;
+
+    IRCData old;
+    {
+        std::lock_guard<std::mutex> lock(data_lock);
+        old                             = data;
+        data.user                       = user;
+        data.nick                       = nick;
+        data.comms_channel              = comms_channel;
+        data.commandandcontrol_channel  = commandandcontrol_channel;
+        data.commandandcontrol_password = commandandcontrol_password;
+        data.address                    = address;
+        data.port                       = port;
+        data.is_bot                     = is_bot;
+        data.steamid                    = steamid;
+    }
+    if (status != running)
+        return;
+    if (old.address != address || old.port != port)
+    {
+        std::cout << "ChIRC: Server changed, reconnecting" << std::endl;
+        ChangeState(false);
+        if (shouldrun)
+            ChangeState(true);
+        return;
+    }
+    applyData(old);
 }
 
-bool ChIRC::ChIRC::sendraw(std::string msg)
+void ChIRC::ChIRC::applyData(const IRCData &old)
 {
-    if (msg.empty())
-        return false;
-    if (status.load() == running)
+    bool commandandcontrol = old.commandandcontrol_channel != data.commandandcontrol_channel;
+    {
+        std::lock_guard<std::mutex> lock(data_lock);
+        // The user name only takes effect on the next connect. A nick in
+        // use goes through the same alternates as on connect.
+        if (old.nick != data.nick)
+            IRC.ChangeNick(data.nick + '-' + std::to_string(data.id));
+        bool comms = old.comms_channel != data.comms_channel;
+        if (comms && !old.comms_channel.empty())
+            send("PART ", old.comms_channel);
+        if (commandandcontrol && !old.commandandcontrol_channel.empty())
+            send("PART ", old.commandandcontrol_channel);
+        else if (old.commandandcontrol_password != data.commandandcontrol_password && data.is_commandandcontrol)
+        {
+            // Most servers refuse +k while a key is set. An empty key is
+            // never sent, it would be taken as a missing parameter.
+            if (!old.commandandcontrol_password.empty())
+                send("MODE ", data.commandandcontrol_channel, " -k ", old.commandandcontrol_password);
+            if (!data.commandandcontrol_password.empty())
+                send("MODE ", data.commandandcontrol_channel, " +k ", data.commandandcontrol_password);
+        }
+        // The old key may be what kept us out, try again with the new one
+        bool rejoin = !commandandcontrol && old.commandandcontrol_password != data.commandandcontrol_password && !data.is_commandandcontrol;
+        joinChannels(comms, commandandcontrol || rejoin);
+    }
+    // Peers keep what our last auth told them
+    if (old.is_bot != data.is_bot || old.steamid != data.steamid)
+        auth_requested = true;
+    // Whoever we knew was in the old channel, they come back by heartbeat
+    // under the same nick if they moved too
+    if (commandandcontrol)
+        retirePeers();
+    // The bus is named after the channel and key. Reopened without
+    // data_lock, its thread takes it.
+    if (bus.isOpen() && (commandandcontrol || old.commandandcontrol_password != data.commandandcontrol_password))
+    {
+        bus.close();
+        openBus();
+    }
+}
+
+void ChIRC::ChIRC::insertPeer(int id, const PeerData &peer)
+{
+    PeerData evicted;
+    int previous = peers.insert(id, peer, evicted);
+    if (previous)
+        evictPeer(previous, std::move(evicted));
+}
+
+void ChIRC::ChIRC::renamePeer(std::string_view nick, std::string_view new_nick)
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    uint32_t row = peers.findByNickname(nick);
+    if (row == PeerTable::npos)
     {
-        if (IRC.SendIRC(msg))
-            return true;
+        // Dormant peers only come back under the nick they had
+        for (auto &i : dormant_peers)
+            if (i.second.nickname == nick)
+                i.second.nickname = new_nick;
+        return;
     }
-    return false;
+    PeerData evicted;
+    int previous = peers.rename(peers.id(row), new_nick, evicted);
+    if (previous)
+        evictPeer(previous, std::move(evicted));
+}
+
+void ChIRC::ChIRC::evictPeer(int id, PeerData &&peer)
+{
+    std::cout << "ChIRC: Peer " << id << " lost its nick, timed out" << std::endl;
+    dormant_peers[id] = std::move(peer);
+    peer_latency.erase(id);
+    direct_endpoints.erase(id);
+    notePeerChange(id, peer_timed_out);
+}
+
+void ChIRC::ChIRC::retirePeers()
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    while (!peers.empty())
+    {
+        int id = peers.id(peers.size() - 1);
+        peers.extract(id, dormant_peers[id]);
+        notePeerChange(id, peer_timed_out);
+    }
+    peer_latency.clear();
+    pending_auth.clear();
+    direct_endpoints.clear();
+}
+
+bool ChIRC::ChIRC::sendraw(std::string_view msg)
+{
+    if (msg.empty())
+        return false;
+    return send(msg);
 }
 bool ChIRC::ChIRC::privmsg(std::string msg, bool command)
 {
     msg = ucccccp::encrypt(msg, 'B');
+    if (msg.empty())
+        return false;
     if (command)
-        return sendraw("PRIVMSG " + data.commandandcontrol_channel + " :" + msg);
+        return send("PRIVMSG ", data.commandandcontrol_channel, " :", msg);
     else
-        return sendraw("PRIVMSG " + data.comms_channel + " :" + msg);
+        return send("PRIVMSG ", data.comms_channel, " :", msg);
+}
+bool ChIRC::ChIRC::replay(const char *path, bool realtime)
+{
+    if (status != off)
+        return false;
+    IRCReplay capture;
+    if (!capture.Open(path))
+        return false;
+    data.is_commandandcontrol = !data.commandandcontrol_channel.empty();
+    size_t chunks             = capture.Run(IRC, realtime);
+    std::cout << "ChIRC: Replayed " << chunks << " chunks from " << path << std::endl;
+    return true;
 }
+
 void ChIRC::ChIRC::Update()
 {
-    static Timer last_restart{};
+    auto now = timers.tick();
     if (status == joining)
     {
         IRC.Disconnect();
         thread.join();
         status = off;
     }
-    if (shouldrun && status == off && last_restart.test_and_set(30000))
+    if (shouldrun && status == off && timers.test_and_set(restart_timer, 30000))
     {
-        updateID();
         ChangeState(true);
     }
     else if (!shouldrun && status == running)
     {
         ChangeState(false);
     }
-    static Timer heartbeat{};
-    if (data.is_commandandcontrol && heartbeat.test_and_set(5000))
-        sendHeartbeat();
+    if (inCommandChannel() && timers.test_and_set(heartbeat_timer, 5000))
+    {
+        // A heartbeat queued while the socket is down never goes out, and
+        // peers would count its sequence number as lost
+        if (status == running && IRC.Connected())
+            sendHeartbeat();
+        if (snapshot.isOpen())
+        {
+            std::lock_guard<std::mutex> lock(peers_lock);
+            snapshot.store(data.id, peers, dormant_peers);
+        }
+    }
+
+    if (status == running)
+    {
+        // Ask everyone NAMES listed right away instead of on the next tick
+        if (bootstrap_pending.exchange(false))
+            timers.schedule(reqauth_timer, 0);
+        if (timers.test_and_set(reqauth_timer, 1000))
+            sendAuthRequests();
+        if (auth_requested && !auth_scheduled)
+        {
+            // Still rate limited to one auth per second
+            auto jitter = std::chrono::milliseconds(std::uniform_int_distribution<int>(0, auth_jitter)(jitter_rng));
+            auto when   = std::max(timers.deadline(auth_timer), now + jitter);
+            timers.schedule(auth_timer, std::chrono::duration_cast<std::chrono::milliseconds>(when - now).count());
+            auth_scheduled = true;
+        }
+        if (auth_scheduled && timers.test_and_set(auth_timer, 1000))
+        {
+            auth_requested = false;
+            auth_scheduled = false;
+            sendAuth();
+        }
+        // Peers can't heartbeat us while we are disconnected
+        if (timers.test_and_set(expiry_timer, 1000))
+        {
+            expirePeers(now);
+            requestMissingChunks(now);
+        }
+    }
+    flushRecords();
+    // After the records so bulk data never delays a heartbeat
+    if (status == running && !blob_sender.empty())
+        sendBlobChunks(now);
+    if (blobs_pending)
+        deliverBlobs();
+    if (peer_changes_pending)
+        notifyPeerObservers();
+}
 
-    int todelete = -1;
-    for (auto &i : peers)
+void ChIRC::ChIRC::notePeerChange(int id, unsigned change)
+{
+    unsigned &changes = peer_changes[id];
+    if (change & peer_timed_out)
     {
-        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - i.second.heartbeat).count() >= 10)
+        // Came and went within one tick, nobody needs to hear about it
+        if (changes & peer_added)
         {
-            todelete = i.first;
+            peer_changes.erase(id);
+            return;
         }
+        changes = peer_timed_out;
     }
-    if (todelete != -1)
+    else if (change & peer_added)
+        changes = (changes & ~peer_timed_out) | change;
+    // An added event already carries the latest state
+    else if (changes & peer_added)
+        changes |= change & ~peer_state_changed;
+    else
+        changes |= change;
+    peer_changes_pending = true;
+}
+
+void ChIRC::ChIRC::notifyPeerObservers()
+{
+    std::vector<PeerEvent> events;
     {
         std::lock_guard<std::mutex> lock(peers_lock);
-        peers.erase(todelete);
-        std::cout << "ChIRC: Timed out peer " << todelete << std::endl;
+        peer_changes_pending = false;
+        if (peer_observers.empty())
+        {
+            peer_changes.clear();
+            return;
+        }
+        events.reserve(peer_changes.size());
+        for (auto &i : peer_changes)
+        {
+            PeerEvent event{ i.first, i.second, {} };
+            uint32_t row = peers.find(i.first);
+            if (row != PeerTable::npos)
+                event.peer = peers.get(row);
+            else
+            {
+                auto dormant = dormant_peers.find(i.first);
+                if (dormant != dormant_peers.end())
+                    event.peer = dormant->second;
+            }
+            events.push_back(std::move(event));
+        }
+        peer_changes.clear();
+    }
+    std::sort(events.begin(), events.end(), [](const PeerEvent &a, const PeerEvent &b) { return a.id < b.id; });
+    // Observers may add or remove observers
+    auto observers = peer_observers;
+    for (auto &event : events)
+        for (auto &observer : observers)
+            observer.second(event);
+}
+
+int ChIRC::ChIRC::addPeerObserver(PeerObserver observer)
+{
+    peer_observers.emplace_back(next_observer, std::move(observer));
+    return next_observer++;
+}
+
+void ChIRC::ChIRC::removePeerObserver(int handle)
+{
+    peer_observers.erase(std::remove_if(peer_observers.begin(), peer_observers.end(), [handle](const std::pair<int, PeerObserver> &i) { return i.first == handle; }), peer_observers.end());
+}
+
+bool ChIRC::ChIRC::getPeerBySteamID(unsigned int steamid, int &id, PeerData &out)
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    uint32_t row = peers.findBySteamID(steamid);
+    if (row == PeerTable::npos)
+        return false;
+    id  = peers.id(row);
+    out = peers.get(row);
+    return true;
+}
+
+bool ChIRC::ChIRC::getPeerByNickname(std::string_view nickname, int &id, PeerData &out)
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    uint32_t row = peers.findByNickname(nickname);
+    if (row == PeerTable::npos)
+        return false;
+    id  = peers.id(row);
+    out = peers.get(row);
+    return true;
+}
+
+bool ChIRC::ChIRC::getPeerLatency(int id, PeerLatencyStats &out)
+{
+    double transit = bus.isLocal(id) ? 0 : IRC.GetLag().average;
+    std::lock_guard<std::mutex> lock(peers_lock);
+    auto found = peer_latency.find(id);
+    if (found == peer_latency.end())
+        return false;
+    out = found->second.stats(PeerLatency::clock::now(), transit);
+    return true;
+}
+
+bool ChIRC::ChIRC::getEchoLatency(PeerLatencyStats &out)
+{
+    std::lock_guard<std::mutex> lock(peers_lock);
+    out = echo_latency.stats(PeerLatency::clock::now(), 0);
+    return out.received != 0;
+}
+
+std::unordered_map<int, ChIRC::PeerLatencyStats> ChIRC::ChIRC::getPeerLatencies()
+{
+    double transit = IRC.GetLag().average;
+    auto now       = PeerLatency::clock::now();
+    std::unordered_map<int, PeerLatencyStats> latencies;
+    std::lock_guard<std::mutex> lock(peers_lock);
+    for (auto &i : peer_latency)
+        latencies.emplace(i.first, i.second.stats(now, bus.isLocal(i.first) ? 0 : transit));
+    return latencies;
+}
+
+std::chrono::time_point<Timer::clock> ChIRC::ChIRC::nextUpdate() const
+{
+    if (status == joining || peer_changes_pending || blobs_pending || bootstrap_pending)
+        return timers.now();
+    if (status != running)
+        return shouldrun && status == off ? timers.deadline(restart_timer) : std::chrono::time_point<Timer::clock>::max();
+    auto next = std::min(timers.deadline(reqauth_timer), timers.deadline(expiry_timer));
+    if (inCommandChannel())
+        next = std::min(next, timers.deadline(heartbeat_timer));
+    // A new request is jittered in Update() first
+    if (auth_requested && !auth_scheduled)
+        return timers.now();
+    if (auth_scheduled)
+        next = std::min(next, timers.deadline(auth_timer));
+    return std::min(next, blob_sender.next());
+}
+
+void ChIRC::ChIRC::expirePeers(std::chrono::time_point<Timer::clock> now)
+{
+    auto connected = connected_at.load();
+    std::lock_guard<std::mutex> lock(peers_lock);
+    // Backwards, erasing moves the last row into the current one
+    for (uint32_t row = peers.size(); row-- > 0;)
+    {
+        if (std::chrono::duration_cast<std::chrono::seconds>(now - std::max(peers.heartbeat(row), connected)).count() >= peer_timeout)
+        {
+            int id = peers.id(row);
+            std::cout << "ChIRC: Timed out peer " << id << std::endl;
+            peers.extract(id, dormant_peers[id]);
+            peer_latency.erase(id);
+            notePeerChange(id, peer_timed_out);
+        }
+    }
+    for (auto i = dormant_peers.begin(); i != dormant_peers.end();)
+    {
+        if (std::chrono::duration_cast<std::chrono::seconds>(now - i->second.heartbeat).count() >= dormant_timeout)
+            i = dormant_peers.erase(i);
+        else
+            ++i;
     }
 }
@@ -3,11 +3,19 @@
 #include <atomic>
 #include <unordered_map>
 #include <mutex>
+#include <random>
+#include "BlobTransfer.hpp"
+#include "DirectChannel.hpp"
+#include "LocalBus.hpp"
+#include "PeerLatency.hpp"
+#include "PeerSnapshot.hpp"
+#include "PeerTable.hpp"
+#include "timer.hpp"
 
 namespace ChIRC
 {
-// Used for storing IRC Client data, should never be modifed while irc thread
-// running
+// Used for storing IRC Client data. UpdateData() changes it while the IRC
+// thread runs, under ChIRC::data_lock.
 struct IRCData
 {
     std::string user;
@@ -29,15 +37,66 @@ struct GameState
     bool is_ingame = false;
 };
 
-// Used for storing data of C&C clients
-struct PeerData
+enum timers
 {
-    std::chrono::time_point<std::chrono::system_clock> heartbeat{};
-    std::string nickname;
-    bool is_bot          = false;
-    int party_size       = -1;
-    bool is_ingame       = false;
-    unsigned int steamid = 0;
+    heartbeat_timer = 0,
+    restart_timer,
+    reqauth_timer,
+    auth_timer,
+    expiry_timer,
+    timer_count
+};
+
+// Unknown peer we have asked to auth
+struct PendingAuth
+{
+    std::chrono::time_point<Timer::clock> first_seen{};
+    std::chrono::time_point<Timer::clock> last_seen{};
+    int attempts = 0;
+    std::chrono::time_point<Timer::clock> next{};
+};
+
+// Bits of PeerEvent::changes
+enum peer_change
+{
+    peer_added         = 1 << 0,
+    peer_authenticated = 1 << 1,
+    // party_size or is_ingame
+    peer_state_changed = 1 << 2,
+    peer_timed_out     = 1 << 3
+};
+
+// Everything that happened to one peer since the previous Update()
+struct PeerEvent
+{
+    int id;
+    unsigned changes;
+    // Current data, or the last we had for a peer that timed out
+    PeerData peer;
+};
+
+typedef std::function<void(const PeerEvent &)> PeerObserver;
+
+// A blob another client sent with sendBlob()
+struct ReceivedBlob
+{
+    // C&C id of the sender
+    int sender;
+    // 0 for data that came over a direct connection
+    int blob;
+    std::string data;
+    bool direct;
+};
+
+typedef std::function<void(const ReceivedBlob &)> BlobCallback;
+
+// Bits of the capability field appended to auth records
+enum peer_caps
+{
+    // Reads several records packed into one C&C message
+    cap_packed = 1 << 0,
+    // Auth carries the endpoint of a DirectChannel
+    cap_direct = 1 << 1
 };
 
 enum statusenum
@@ -61,25 +120,152 @@ class ChIRC
     std::atomic<statusenum> status{ off };
     // If IRC is supposed to run, used for autorestart
     bool shouldrun{ false };
-    // Contains core irc data, should'nt be modified while main thread is
-    // running
+    // Contains core irc data. Only UpdateData() writes it, the IRC thread
+    // reads it under data_lock. is_commandandcontrol is the exception: it is
+    // cleared when we (re)join and set when the server confirms, also under
+    // data_lock.
     IRCData data;
+    mutable std::mutex data_lock;
+    // Nick the server registered us under, alternates and NICK changes
+    // included. Empty while not registered, shares data_lock.
+    std::string registered_nick;
     // IRC client itself
     IRCClient IRC;
-    // Unordered map containing peers
-    std::unordered_map<int, PeerData> peers;
+    // Authenticated peers, indexed for the queries in queryPeers()
+    PeerTable peers;
+    // Peers that timed out recently. A heartbeat brings them back without a
+    // new auth round. Shares peers_lock.
+    std::unordered_map<int, PeerData> dormant_peers;
     std::mutex peers_lock;
+    // Unknown ids heartbeating in the C&C channel, asked for in batches.
+    // Shares peers_lock.
+    std::unordered_map<int, PendingAuth> pending_auth;
+    // peer_change bits per peer since the last Update(). Shares peers_lock.
+    std::unordered_map<int, unsigned> peer_changes;
+    // Delays and loss of the stamped heartbeats of authenticated peers.
+    // Shares peers_lock.
+    std::unordered_map<int, PeerLatency> peer_latency;
+    // Our own heartbeats echoed back by the server. Shares peers_lock.
+    PeerLatency echo_latency;
+    // Ask for echo-message on the next connect
+    std::atomic<bool> echo_wanted{ false };
+    // Sequence number of our last heartbeat, only touched by the thread
+    // calling Update()
+    uint32_t heartbeat_seq{ 0 };
+    std::atomic<bool> peer_changes_pending{ false };
+    // Only touched by the thread calling Update()
+    std::vector<std::pair<int, PeerObserver>> peer_observers;
+    int next_observer{ 1 };
+    // Set by the IRC thread when a peer asked for our auth
+    std::atomic<bool> auth_requested{ false };
+    // Update() picked a jittered time for the requested auth
+    bool auth_scheduled{ false };
+    std::minstd_rand jitter_rng{ std::random_device{}() };
+    // Set by the IRC thread when NAMES showed members we have to ask for
+    // auth
+    std::atomic<bool> bootstrap_pending{ false };
+    // Peers are not timed out for a full timeout after (re)connecting
+    std::atomic<std::chrono::time_point<Timer::clock>> connected_at{};
+    // Deadlines of everything Update() does periodically
+    TimerQueue<timer_count> timers;
+    // Optional on disk copy of our id and the peer table
+    PeerSnapshot snapshot;
     // Contains backwards compatible callbacks
-    std::vector<std::pair<std::string, std::function<void(IRCMessage, IRCClient *)>>> callbacks;
+    std::vector<std::pair<std::string, std::function<void(IRCMessage const &, IRCClient *)>>> callbacks;
+    // Reused for decrypting C&C payloads on the IRC thread
+    std::string payload;
+    // C&C records that came in a batch still open, applied together when
+    // it ends. Only touched by the IRC thread.
+    struct BatchedRecord
+    {
+        std::string batch;
+        std::string record;
+        std::string nick;
+        PeerLatency::clock::time_point received;
+    };
+    std::unordered_map<std::string, std::string> open_batches;
+    std::vector<BatchedRecord> batched_records;
+    // C&C records queued during Update(), sent at its end. Only touched by
+    // the thread calling Update().
+    std::string outbox;
+    // Blobs we send, only touched by the thread calling Update()
+    BlobSender blob_sender;
+    BlobCallback blob_callback;
+    // Blobs being received and the completed ones waiting for Update()
+    BlobAssembler blob_assembler;
+    std::vector<ReceivedBlob> completed_blobs;
+    // Messages a direct connection could not deliver, by peer id
+    std::vector<std::pair<int, std::string>> direct_fallback;
+    // Chunks of our blobs others asked for again, by blob id
+    std::vector<std::pair<int, uint32_t>> blob_resends;
+    std::mutex blobs_lock;
+    std::atomic<bool> blobs_pending{ false };
+    // Endpoints peers advertised in their auth. Shares peers_lock.
+    std::unordered_map<int, DirectEndpoint> direct_endpoints;
+    // Declared after everything their threads call into
+    DirectChannel direct;
+    LocalBus bus;
     // Contains game data that might change at any moment. Thread safe.
     std::atomic<GameState> game_state;
 
     void IRCThread();
     void ChangeState(bool state);
-    static void basicHandler(IRCMessage msg, IRCClient *irc, void *context);
+    // Sends the JOIN and MODE lines for our channels. Needs data_lock.
+    void joinChannels(bool comms, bool commandandcontrol);
+    // Brings the live connection from the old config to data
+    void applyData(const IRCData &old);
+    bool isCommsChannel(std::string_view channel);
+    bool isCommandChannel(std::string_view channel);
+    // True once the server confirmed our JOIN of the C&C channel, until we
+    // leave it or reconnect
+    bool inCommandChannel() const;
+    // Nick peers see our records under
+    std::string ircNick() const;
+    static void basicHandler(IRCEvent const &event, IRCMessage const &msg, IRCClient *irc, void *context);
+    // Handles a decrypted record from the C&C channel, received when the
+    // server relayed it if it told us
+    void handleCommand(std::string_view rawmsg, std::string_view nick, PeerLatency::clock::time_point received);
+    // Handles a record of ours the server echoed back
+    void handleEcho(std::string_view rawmsg, PeerLatency::clock::time_point received);
+    // Applies the records held back for a batch once it ended
+    void handleBatch(IRCBatchEvent const &batch);
     void updateID();
     void sendHeartbeat();
     void sendAuth();
+    void sendAuthRequests();
+    // Takes the members of a NAMES reply for the C&C channel as peers
+    void learnNames(std::string_view names);
+    void queueRecord(std::string_view record);
+    // Sends the queued records, packed if every peer reads packed messages
+    void flushRecords();
+    bool peersReadPacked();
+    // True if every peer we know is on our local bus
+    bool peersAllLocal();
+    // Base64 characters of a blob chunk that fit one comms message
+    size_t blobChunkSize();
+    void sendBlobChunks(std::chrono::time_point<Timer::clock> now);
+    void handleBlobChunk(std::string_view record);
+    void deliverBlobs();
+    // Expires incomplete blobs and asks for the chunks of stalled ones
+    void requestMissingChunks(std::chrono::time_point<Timer::clock> now);
+    void expirePeers(std::chrono::time_point<Timer::clock> now);
+    // Adds or replaces peer id. Needs peers_lock.
+    void insertPeer(int id, const PeerData &peer);
+    // Follows a peer's NICK so lookups and dormant revival use its new nick
+    void renamePeer(std::string_view nick, std::string_view new_nick);
+    // Times out a peer the table dropped because another one took its
+    // nick, it left IRC under it. Needs peers_lock.
+    void evictPeer(int id, PeerData &&peer);
+    // Moves every peer to dormant_peers, for when the C&C channel changed
+    void retirePeers();
+    // Needs peers_lock
+    void notePeerChange(int id, unsigned change);
+    void notifyPeerObservers();
+    // Sends one line made of the given pieces while running, see IRCFormat.h
+    template <typename... Args> bool send(Args const &...args)
+    {
+        return status.load() == running && IRC.SendIRC(args...);
+    }
 
 public:
     void Disconnect()
@@ -92,8 +278,14 @@ public:
         shouldrun = true;
         ChangeState(true);
     }
+    // Keeps our id and the peer table in path across restarts. Must be set
+    // before connecting.
+    bool setSnapshot(const char *path);
+    // Applies a new config to a running connection in place, nick and
+    // channel changes don't reconnect. Only a new server does. Only call from
+    // the thread calling Update().
     void UpdateData(std::string user, std::string nick, std::string comms_channel, std::string commandandcontrol_channel, std::string commandandcontrol_password, std::string address, int port, bool is_bot, unsigned int steamid);
-    bool sendraw(std::string msg);
+    bool sendraw(std::string_view msg);
     bool privmsg(std::string msg, bool command = false);
     void setState(GameState &state)
     {
@@ -106,7 +298,39 @@ public:
 
     void Update();
 
-    void installCallback(std::string cmd, std::function<void(IRCMessage, IRCClient *)> func)
+    // Round trip times to the IRC server
+    IRCLagStats getLag()
+    {
+        return IRC.GetLag();
+    }
+    // Comms channel chat dropped while it flooded
+    IRCOverloadStats getOverloadStats()
+    {
+        return IRC.GetOverloadStats();
+    }
+    // io_uring or poll for the IRC socket, applied on the next connect
+    bool setSocketBackend(IRCSocketBackend backend)
+    {
+        return IRC.SetSocketBackend(backend);
+    }
+    // When Update() next has work to do, for callers that don't call it
+    // every frame
+    std::chrono::time_point<Timer::clock> nextUpdate() const;
+
+    // Records all IRC traffic into a capture file, see IRCCapture.h
+    bool startCapture(const char *path)
+    {
+        return IRC.StartCapture(path);
+    }
+    void stopCapture()
+    {
+        IRC.StopCapture();
+    }
+    // Feeds a capture through the handlers instead of a live connection,
+    // only possible while disconnected
+    bool replay(const char *path, bool realtime);
+
+    void installCallback(std::string cmd, std::function<void(IRCMessage const &, IRCClient *)> func)
     {
         callbacks.emplace_back(cmd, func);
     }
@@ -114,14 +338,75 @@ public:
     {
         return data;
     }
+    // Sends data of any size over the comms channel in chunks, paced so
+    // heartbeats and the server's flood limits are respected. Returns the
+    // blob id, 0 if data is empty or too large. Only call from the thread
+    // calling Update().
+    int sendBlob(std::string_view data)
+    {
+        return blob_sender.queueBlob(data, blobChunkSize());
+    }
+    // Joins the other instances on this host using the same server and C&C
+    // channel. C&C records reach them through shared memory, and IRC is
+    // skipped while all our peers are local. UpdateData() has to be called
+    // first.
+    bool openBus();
+    // Listens for direct connections from peers on address, advertised in
+    // our auth with the token peers have to present. What arrives there is
+    // as trusted as the comms channel, not the C&C one. UpdateData() has to
+    // be called first.
+    bool openDirect(const char *address, int port = 0);
+    // Sends data to one peer over a direct connection, or as a blob over
+    // IRC if the peer has none or can't be reached. Only call from the
+    // thread calling Update().
+    bool sendToPeer(int id, std::string_view data);
+    // Blob chunks sent per second and in a burst
+    void setBlobRate(double chunks_per_second, unsigned burst)
+    {
+        blob_sender.setRate(chunks_per_second, burst);
+    }
+    // callback is called from Update() for every complete blob received
+    void setBlobCallback(BlobCallback callback)
+    {
+        blob_callback = std::move(callback);
+    }
+    // observer is called from Update() with one coalesced PeerEvent per
+    // changed peer. Returns a handle for removePeerObserver().
+    int addPeerObserver(PeerObserver observer);
+    void removePeerObserver(int handle);
     const std::unordered_map<int, PeerData> getPeers()
     {
         std::lock_guard<std::mutex> lock(peers_lock);
-        return peers;
+        return peers.toMap();
+    }
+    // Runs f(const PeerTable &) with the peer table locked, for indexed
+    // lookups and filters without copying the table. Rows are only valid
+    // inside f.
+    template <typename F> void queryPeers(F &&f)
+    {
+        std::lock_guard<std::mutex> lock(peers_lock);
+        f(static_cast<const PeerTable &>(peers));
+    }
+    bool getPeerBySteamID(unsigned int steamid, int &id, PeerData &out);
+    bool getPeerByNickname(std::string_view nickname, int &id, PeerData &out);
+    // How stale what we know of peer id is and where the delay comes from,
+    // false until it sent a heartbeat with a timestamp
+    bool getPeerLatency(int id, PeerLatencyStats &out);
+    std::unordered_map<int, PeerLatencyStats> getPeerLatencies();
+    // How long our heartbeats took to reach the server, with our clock on
+    // both ends the offset is the quickest trip. lost counts heartbeats the
+    // server never echoed. False without echo-message.
+    bool getEchoLatency(PeerLatencyStats &out);
+    // Asks the server to echo our messages from the next connect on, which
+    // getEchoLatency() needs. Off by default since every C&C message we
+    // send comes back to us.
+    void measureEchoLatency(bool enable)
+    {
+        echo_wanted = enable;
     }
     ChIRC()
     {
-        IRC.HookIRCCommand("PRIVMSG", this, basicHandler);
+        IRC.HookIRCEvent(this, basicHandler);
     }
     ~ChIRC()
     {
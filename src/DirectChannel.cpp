@@ -0,0 +1,407 @@
+#include "DirectChannel.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include "IRCFormat.h"
+#include "../ucccccp/ucccccp.hpp"
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+constexpr std::string_view direct_hello = "cc_direct";
+// Longest frame taken from a connection that did not say who it is yet
+constexpr uint32_t direct_max_hello = 256;
+
+static uint64_t endpointKey(ChIRC::DirectEndpoint endpoint)
+{
+    return uint64_t(endpoint.address) << 16 | endpoint.port;
+}
+
+// Length prefixed frame, the length in network byte order
+static std::string makeFrame(std::string_view data)
+{
+    std::string frame(4, '\0');
+    uint32_t length = data.size();
+    frame[0]        = char(length >> 24);
+    frame[1]        = char(length >> 16);
+    frame[2]        = char(length >> 8);
+    frame[3]        = char(length);
+    frame.append(data);
+    return frame;
+}
+
+#ifndef _WIN32
+bool ChIRC::DirectChannel::open(int id, const char *address, int port, Receiver receiver, Undeliverable undeliverable, Verifier verifier)
+{
+    close();
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    {
+        std::cout << "ChIRC: Invalid direct channel address " << address << std::endl;
+        return false;
+    }
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on   = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    socklen_t length = sizeof(addr);
+    if (listener == -1 || bind(listener, (sockaddr *) &addr, sizeof(addr)) == -1 || ::listen(listener, 16) == -1 || getsockname(listener, (sockaddr *) &addr, &length) == -1 || pipe(wake_fds) == -1)
+    {
+        std::cout << "ChIRC: Unable to open direct channel on " << address << ':' << port << std::endl;
+        close();
+        return false;
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+    local.address       = ntohl(addr.sin_addr.s_addr);
+    local.port          = ntohs(addr.sin_port);
+    this->id            = id;
+    this->receiver      = std::move(receiver);
+    this->undeliverable = std::move(undeliverable);
+    this->verifier      = std::move(verifier);
+    std::random_device random;
+    while (!local.token)
+        local.token = uint64_t(random()) << 32 | random();
+    running = true;
+    thread              = std::thread(&DirectChannel::run, this);
+    return true;
+}
+
+void ChIRC::DirectChannel::close()
+{
+    running = false;
+    if (thread.joinable())
+    {
+        wake();
+        thread.join();
+    }
+    for (auto &i : outgoing)
+        if (i.second.fd != -1)
+            ::close(i.second.fd);
+    outgoing.clear();
+    unreachable.clear();
+    for (auto &i : incoming)
+        ::close(i.fd);
+    incoming.clear();
+    for (int &fd : wake_fds)
+    {
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+    }
+    if (listener != -1)
+        ::close(listener);
+    listener = -1;
+    local    = {};
+}
+
+void ChIRC::DirectChannel::wake()
+{
+    char byte = 0;
+    if (write(wake_fds[1], &byte, 1) == -1)
+        return;
+}
+
+bool ChIRC::DirectChannel::send(int peer, DirectEndpoint endpoint, std::string_view data)
+{
+    if (!running || !endpoint.port || data.size() > direct_max_message)
+        return false;
+    auto now = Timer::clock::now();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto failed = unreachable.find(endpointKey(endpoint));
+        if (failed != unreachable.end())
+        {
+            if (now < failed->second)
+                return false;
+            unreachable.erase(failed);
+        }
+        Outgoing &out = outgoing[peer];
+        if (out.queued + data.size() > direct_send_limit)
+            return false;
+        // Takes effect on the next connect if the peer moved
+        out.endpoint = endpoint;
+        out.frames.push_back(makeFrame(data));
+        out.queued += data.size();
+    }
+    wake();
+    return true;
+}
+
+bool ChIRC::DirectChannel::startConnect(Outgoing &out, std::chrono::time_point<Timer::clock> now)
+{
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(out.endpoint.port);
+    addr.sin_addr.s_addr = htonl(out.endpoint.address);
+    out.fd               = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (out.fd == -1)
+        return false;
+    int on = 1;
+    setsockopt(out.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    out.connecting = true;
+    out.deadline   = now + std::chrono::milliseconds(direct_connect_timeout);
+    // Tells the other side who we are, it drops connections without it
+    char hello[64];
+    size_t length = IRCFormat::Write(hello, sizeof(hello), direct_hello, '$', id, '$', local.token);
+    out.frames.push_front(makeFrame(ucccccp::encrypt(std::string(hello, length), 'B')));
+    out.offset = 0;
+    out.hello  = true;
+    if (::connect(out.fd, (sockaddr *) &addr, sizeof(addr)) == 0)
+        out.connecting = false;
+    else if (errno != EINPROGRESS)
+        return false;
+    return true;
+}
+
+bool ChIRC::DirectChannel::writeFrames(Outgoing &out)
+{
+    while (!out.frames.empty())
+    {
+        std::string &frame = out.frames.front();
+        ssize_t sent       = ::send(out.fd, frame.data() + out.offset, frame.size() - out.offset, MSG_NOSIGNAL);
+        if (sent == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        out.offset += sent;
+        if (out.offset < frame.size())
+            return true;
+        if (out.hello)
+            out.hello = false;
+        else
+            out.queued -= frame.size() - 4;
+        out.frames.pop_front();
+        out.offset = 0;
+    }
+    return true;
+}
+
+void ChIRC::DirectChannel::fail(int peer, Outgoing &out, std::vector<std::pair<int, std::string>> &failed)
+{
+    std::cout << "ChIRC: Direct connection to peer " << peer << " failed, falling back to IRC" << std::endl;
+    if (out.fd != -1)
+        ::close(out.fd);
+    out.fd = -1;
+    unreachable[endpointKey(out.endpoint)] = Timer::clock::now() + std::chrono::seconds(direct_retry);
+    if (out.hello)
+        out.frames.pop_front();
+    // A partly written message is sent again in full
+    for (auto &frame : out.frames)
+        failed.emplace_back(peer, frame.substr(4));
+    out.frames.clear();
+}
+
+bool ChIRC::DirectChannel::readFrames(Incoming &in)
+{
+    char buffer[16384];
+    while (true)
+    {
+        ssize_t bytes = recv(in.fd, buffer, sizeof(buffer), 0);
+        if (bytes <= 0)
+            return bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        in.buffer.append(buffer, bytes);
+        // Frames are taken as they complete, so the buffer never holds more
+        // than one frame and a read's worth of the next
+        if (!takeFrames(in))
+            return false;
+    }
+}
+
+bool ChIRC::DirectChannel::takeFrames(Incoming &in)
+{
+    size_t pos = 0;
+    while (in.buffer.size() - pos >= 4)
+    {
+        auto *p         = reinterpret_cast<const uint8_t *>(in.buffer.data() + pos);
+        uint32_t length = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+        // Checked before the frame is buffered, not once it is complete
+        if (length > (in.peer ? direct_max_message : direct_max_hello))
+            return false;
+        if (in.buffer.size() - pos - 4 < length)
+            break;
+        std::string_view frame(in.buffer.data() + pos + 4, length);
+        pos += 4 + length;
+        if (in.peer)
+            receiver(in.peer, std::string(frame));
+        else if (!takeHello(in, frame))
+            return false;
+    }
+    in.buffer.erase(0, pos);
+    return true;
+}
+
+bool ChIRC::DirectChannel::takeHello(Incoming &in, std::string_view data)
+{
+    // cc_direct$id$token
+    std::string frame(data);
+    if (!ucccccp::validate(frame))
+        return false;
+    std::string decrypted = ucccccp::decrypt(frame);
+    std::string_view hello(decrypted);
+    if (hello.compare(0, direct_hello.size(), direct_hello) != 0 || hello.size() <= direct_hello.size() + 1)
+        return false;
+    const char *end = hello.data() + hello.size();
+    int peer        = 0;
+    uint64_t token  = 0;
+    auto result     = std::from_chars(hello.data() + direct_hello.size() + 1, end, peer);
+    if (result.ec != std::errc() || !peer || result.ptr == end || *result.ptr != '$')
+        return false;
+    if (std::from_chars(result.ptr + 1, end, token).ec != std::errc() || !verifier(peer, token))
+    {
+        std::cout << "ChIRC: Refused direct connection claiming to be peer " << peer << std::endl;
+        return false;
+    }
+    in.peer = peer;
+    return true;
+}
+
+void ChIRC::DirectChannel::run()
+{
+    std::vector<pollfd> fds;
+    std::vector<int> polled;
+    std::vector<std::pair<int, std::string>> failed;
+    while (running)
+    {
+        auto now = Timer::clock::now();
+        fds.clear();
+        polled.clear();
+        fds.push_back({ wake_fds[0], POLLIN, 0 });
+        fds.push_back({ listener, POLLIN, 0 });
+        for (auto &in : incoming)
+            fds.push_back({ in.fd, POLLIN, 0 });
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto i = outgoing.begin(); i != outgoing.end();)
+            {
+                Outgoing &out = i->second;
+                if (out.fd == -1 && !out.frames.empty() && !startConnect(out, now))
+                {
+                    fail(i->first, out, failed);
+                    i = outgoing.erase(i);
+                    continue;
+                }
+                // Idle connections are only watched for the other side
+                // closing them
+                if (out.fd != -1)
+                {
+                    fds.push_back({ out.fd, short(out.connecting || !out.frames.empty() ? POLLOUT : POLLIN), 0 });
+                    polled.push_back(i->first);
+                }
+                ++i;
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), 250) == -1 && errno != EINTR)
+            break;
+        now = Timer::clock::now();
+
+        char drain[64];
+        while (read(wake_fds[0], drain, sizeof(drain)) > 0)
+            ;
+
+        size_t index = 2;
+        for (auto in = incoming.begin(); in != incoming.end(); ++index)
+        {
+            bool keep = true;
+            if (fds[index].revents)
+                keep = readFrames(*in);
+            if (!in->peer && now - in->accepted > std::chrono::seconds(direct_hello_timeout))
+                keep = false;
+            if (keep)
+                ++in;
+            else
+            {
+                ::close(in->fd);
+                in = incoming.erase(in);
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            size_t pending = std::count_if(incoming.begin(), incoming.end(), [](const Incoming &in) { return !in.peer; });
+            int fd;
+            while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+            {
+                if (pending >= direct_max_pending)
+                {
+                    ::close(fd);
+                    continue;
+                }
+                pending++;
+                Incoming in;
+                in.fd       = fd;
+                in.accepted = now;
+                incoming.push_back(std::move(in));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (size_t i = 0; i < polled.size(); i++, index++)
+            {
+                auto found = outgoing.find(polled[i]);
+                if (found == outgoing.end())
+                    continue;
+                Outgoing &out = found->second;
+                short events  = fds[index].revents;
+                bool ok       = true;
+                if (out.connecting)
+                {
+                    int error      = 0;
+                    socklen_t size = sizeof(error);
+                    if (events & (POLLOUT | POLLERR | POLLHUP))
+                    {
+                        getsockopt(out.fd, SOL_SOCKET, SO_ERROR, &error, &size);
+                        ok             = !error;
+                        out.connecting = false;
+                    }
+                    else if (now > out.deadline)
+                        ok = false;
+                }
+                else if (out.frames.empty() && events)
+                {
+                    // Closed by the other side while idle, reconnect on the
+                    // next send
+                    ::close(out.fd);
+                    out.fd = -1;
+                    continue;
+                }
+                else if (events & (POLLERR | POLLHUP))
+                    ok = false;
+                if (ok && !out.connecting)
+                    ok = writeFrames(out);
+                if (ok)
+                    continue;
+                fail(found->first, out, failed);
+                outgoing.erase(found);
+            }
+        }
+        for (auto &i : failed)
+            undeliverable(i.first, std::move(i.second));
+        failed.clear();
+    }
+}
+#else
+bool ChIRC::DirectChannel::open(int id, const char *address, int port, Receiver receiver, Undeliverable undeliverable, Verifier verifier)
+{
+    std::cout << "ChIRC: Direct channels are not supported on this platform" << std::endl;
+    return false;
+}
+
+void ChIRC::DirectChannel::close()
+{
+}
+
+bool ChIRC::DirectChannel::send(int peer, DirectEndpoint endpoint, std::string_view data)
+{
+    return false;
+}
+#endif
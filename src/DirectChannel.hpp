@@ -0,0 +1,143 @@
+#ifndef CH_DIRECTCHANNEL_HPP
+#define CH_DIRECTCHANNEL_HPP
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "timer.hpp"
+
+namespace ChIRC
+{
+// Largest message accepted over a direct connection, in bytes
+constexpr uint32_t direct_max_message = 1 << 20;
+// Most bytes queued for one peer before sends fall back to IRC
+constexpr size_t direct_send_limit = 4 << 20;
+// Milliseconds a connection attempt may take
+constexpr int direct_connect_timeout = 2000;
+// Seconds an endpoint that failed is not tried again
+constexpr int direct_retry = 60;
+// Seconds an incoming connection may stay silent before saying who it is
+constexpr int direct_hello_timeout = 5;
+// Most incoming connections waiting for their hello, more are refused
+constexpr size_t direct_max_pending = 16;
+
+// IPv4 address and port in host byte order and the token proving who
+// connects from there, as advertised in auth records
+struct DirectEndpoint
+{
+    uint32_t address = 0;
+    uint16_t port    = 0;
+    uint64_t token   = 0;
+};
+
+// DCC style TCP connections straight to other clients. Every client listens
+// on its own endpoint, messages to a peer go over a connection we open to
+// it, so each connection carries data one way. A connection starts with an
+// encrypted hello naming the sender, followed by length prefixed messages.
+// All IO happens on a thread of its own.
+//
+// The hello carries the random token the sender advertised in its auth over
+// IRC, and is only accepted if it matches. That keeps out anyone who cannot
+// read the C&C channel, but the encryption is shared by everyone who can, so
+// treat the connection like the comms channel: data from a peer, never
+// commands.
+class DirectChannel
+{
+public:
+    // Called on the channel's thread with a message from another client
+    typedef std::function<void(int sender, std::string &&data)> Receiver;
+    // Called on the channel's thread with a message that could not be
+    // delivered, the caller should send it some other way
+    typedef std::function<void(int peer, std::string &&data)> Undeliverable;
+    // Called on the channel's thread with the hello of an incoming
+    // connection, true if token is the one peer advertised over IRC
+    typedef std::function<bool(int peer, uint64_t token)> Verifier;
+
+    // Listens on address (port 0 picks one) and starts the thread. id and
+    // a fresh token are sent to the clients we connect to.
+    bool open(int id, const char *address, int port, Receiver receiver, Undeliverable undeliverable, Verifier verifier);
+    void close();
+    bool isOpen() const
+    {
+        return listener != -1;
+    }
+    DirectEndpoint endpoint() const
+    {
+        return local;
+    }
+    // Queues data for peer. False if its endpoint failed recently or too
+    // much is queued already, nothing was queued then.
+    bool send(int peer, DirectEndpoint endpoint, std::string_view data);
+
+    DirectChannel() = default;
+    DirectChannel(const DirectChannel &) = delete;
+    DirectChannel &operator=(const DirectChannel &) = delete;
+    ~DirectChannel()
+    {
+        close();
+    }
+
+private:
+    struct Outgoing
+    {
+        int fd{ -1 };
+        DirectEndpoint endpoint;
+        bool connecting{ false };
+        // The first frame is our hello and not written completely yet
+        bool hello{ false };
+        std::chrono::time_point<Timer::clock> deadline{};
+        // Whole frames, the first one is written from offset on
+        std::deque<std::string> frames;
+        size_t offset{ 0 };
+        size_t queued{ 0 };
+    };
+    struct Incoming
+    {
+        int fd{ -1 };
+        // 0 until the hello arrived
+        int peer{ 0 };
+        std::string buffer;
+        std::chrono::time_point<Timer::clock> accepted{};
+    };
+
+    void run();
+    void wake();
+    bool startConnect(Outgoing &out, std::chrono::time_point<Timer::clock> now);
+    bool writeFrames(Outgoing &out);
+    // Closes the connection and hands its messages to failed
+    void fail(int peer, Outgoing &out, std::vector<std::pair<int, std::string>> &failed);
+    // False if the connection has to be closed
+    bool readFrames(Incoming &in);
+    // Hands complete frames in the buffer on, false on a bad frame
+    bool takeFrames(Incoming &in);
+    bool takeHello(Incoming &in, std::string_view data);
+
+    int id{ 0 };
+    int listener{ -1 };
+    // Pipe waking the thread when something was queued
+    int wake_fds[2]{ -1, -1 };
+    DirectEndpoint local;
+    Receiver receiver;
+    Undeliverable undeliverable;
+    Verifier verifier;
+    std::thread thread;
+    std::atomic<bool> running{ false };
+
+    // Outgoing connections by peer id and endpoints that failed recently,
+    // by address << 16 | port
+    std::mutex lock;
+    std::unordered_map<int, Outgoing> outgoing;
+    std::unordered_map<uint64_t, std::chrono::time_point<Timer::clock>> unreachable;
+    // Only touched by the thread
+    std::vector<Incoming> incoming;
+};
+} // namespace ChIRC
+#endif
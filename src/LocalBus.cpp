@@ -0,0 +1,264 @@
+#include "LocalBus.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+constexpr char bus_magic[8] = "CHIRCBS";
+// Milliseconds the bus thread sleeps between checks that it should stop
+constexpr int bus_wait_timeout = 100;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "LocalBus needs address free atomics");
+
+#ifdef __linux__
+// Shared (not private) futexes, the waiters are in other processes
+static void futexWait(std::atomic<uint32_t> &word, uint32_t value, int timeout)
+{
+    timespec ts{ timeout / 1000, long(timeout % 1000) * 1000000 };
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, &ts, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+static bool processAlive(uint32_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+bool ChIRC::LocalBus::open(const std::string &name, int id, const std::string &nickname, Receiver receiver)
+{
+    close();
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(BusHeader)) == -1)
+    {
+        std::cout << "ChIRC: Unable to open local bus " << name << std::endl;
+        close();
+        return false;
+    }
+    void *map = mmap(nullptr, sizeof(BusHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        std::cout << "ChIRC: Unable to map local bus " << name << std::endl;
+        close();
+        return false;
+    }
+    header = static_cast<BusHeader *>(map);
+    // The first instance stamps a new segment, a zeroed one is already valid
+    uint32_t version = 0;
+    if (header->version.compare_exchange_strong(version, bus_version))
+        memcpy(header->magic, bus_magic, sizeof(bus_magic));
+    else if (version != bus_version)
+    {
+        std::cout << "ChIRC: Local bus " << name << " belongs to another version" << std::endl;
+        close();
+        return false;
+    }
+
+    this->id       = id;
+    this->pid      = getpid();
+    this->nickname = nickname.substr(0, sizeof(BusCell::nickname));
+    for (auto &candidate : header->slots)
+    {
+        if (claim(candidate))
+        {
+            slot = &candidate;
+            break;
+        }
+    }
+    if (!slot)
+    {
+        std::cout << "ChIRC: Local bus " << name << " is full" << std::endl;
+        close();
+        return false;
+    }
+    this->receiver = std::move(receiver);
+    running        = true;
+    thread         = std::thread(&LocalBus::run, this);
+    return true;
+}
+
+bool ChIRC::LocalBus::claim(BusSlot &candidate)
+{
+    uint32_t owner = candidate.pid.load();
+    // Left behind by a process that died without closing
+    if (owner && processAlive(owner))
+        return false;
+    if (!candidate.pid.compare_exchange_strong(owner, pid))
+        return false;
+    candidate.id = 0;
+    candidate.write.store(0);
+    candidate.read.store(0);
+    for (auto &cell : candidate.cells)
+    {
+        cell.sequence.store(0);
+        cell.writer.store(0);
+    }
+    stalled_position = UINT64_MAX;
+    candidate.id     = id;
+    return true;
+}
+
+void ChIRC::LocalBus::close()
+{
+    running = false;
+    if (thread.joinable())
+    {
+        futexWake(slot->doorbell);
+        thread.join();
+    }
+    if (slot)
+    {
+        slot->id  = 0;
+        slot->pid = 0;
+        slot      = nullptr;
+    }
+    if (header)
+    {
+        munmap(header, sizeof(BusHeader));
+        header = nullptr;
+    }
+    if (fd != -1)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+int ChIRC::LocalBus::broadcast(std::string_view record)
+{
+    if (!slot || record.size() > bus_record_size)
+        return 0;
+    int delivered = 0;
+    for (auto &other : header->slots)
+    {
+        if (&other == slot || !other.pid.load(std::memory_order_relaxed) || !other.id.load(std::memory_order_relaxed))
+            continue;
+        uint64_t position = other.write.load(std::memory_order_relaxed);
+        while (true)
+        {
+            BusCell &cell     = other.cells[position % bus_mailbox_size];
+            uint64_t lap      = position / bus_mailbox_size;
+            uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+            if (sequence == 2 * lap)
+            {
+                if (!other.write.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    continue;
+                cell.writer.store(pid, std::memory_order_relaxed);
+                cell.sender = id;
+                cell.length = record.size();
+                memcpy(cell.nickname, nickname.data(), nickname.size());
+                if (nickname.size() < sizeof(cell.nickname))
+                    cell.nickname[nickname.size()] = '\0';
+                memcpy(cell.record, record.data(), record.size());
+                // Fails if the owner gave up on us, the record is lost then
+                uint64_t claimed = 2 * lap;
+                if (!cell.sequence.compare_exchange_strong(claimed, 2 * lap + 1, std::memory_order_release, std::memory_order_relaxed))
+                    break;
+                other.doorbell.fetch_add(1, std::memory_order_release);
+                futexWake(other.doorbell);
+                delivered++;
+                break;
+            }
+            // Still holds the previous lap, the mailbox is full
+            if (sequence < 2 * lap)
+                break;
+            position = other.write.load(std::memory_order_relaxed);
+        }
+    }
+    return delivered;
+}
+
+bool ChIRC::LocalBus::isLocal(int id) const
+{
+    if (!slot || !id)
+        return false;
+    for (auto &other : header->slots)
+        if (&other != slot && other.pid.load(std::memory_order_relaxed) && other.id.load(std::memory_order_relaxed) == id)
+            return true;
+    return false;
+}
+
+bool ChIRC::LocalBus::writerGone(const BusCell &cell, uint64_t position)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (position != stalled_position)
+    {
+        stalled_position = position;
+        stalled_since    = now;
+    }
+    uint32_t writer = cell.writer.load(std::memory_order_relaxed);
+    // A live writer that stalls this long may still finish its copy late,
+    // into the record of whoever gets the cell next
+    return (writer && !processAlive(writer)) || now - stalled_since >= std::chrono::milliseconds(bus_writer_timeout);
+}
+
+void ChIRC::LocalBus::run()
+{
+    while (running)
+    {
+        uint32_t doorbell = slot->doorbell.load(std::memory_order_acquire);
+        uint64_t position = slot->read.load(std::memory_order_relaxed);
+        bool drained      = true;
+        while (true)
+        {
+            BusCell &cell = slot->cells[position % bus_mailbox_size];
+            uint64_t lap  = position / bus_mailbox_size;
+            if (cell.sequence.load(std::memory_order_acquire) != 2 * lap + 1)
+            {
+                // Claimed by a writer that never finished, everything
+                // behind it would wait forever
+                if (position >= slot->write.load(std::memory_order_relaxed) || !writerGone(cell, position))
+                    break;
+                uint64_t claimed = 2 * lap;
+                cell.writer.store(0, std::memory_order_relaxed);
+                if (cell.sequence.compare_exchange_strong(claimed, 2 * (lap + 1), std::memory_order_acq_rel))
+                {
+                    std::cout << "ChIRC: Skipped a local bus record its writer never finished" << std::endl;
+                    slot->read.store(++position, std::memory_order_relaxed);
+                }
+                continue;
+            }
+            drained = false;
+            receiver(std::string_view(cell.record, std::min<size_t>(cell.length, bus_record_size)), std::string_view(cell.nickname, strnlen(cell.nickname, sizeof(cell.nickname))));
+            cell.writer.store(0, std::memory_order_relaxed);
+            cell.sequence.store(2 * (lap + 1), std::memory_order_release);
+            slot->read.store(++position, std::memory_order_relaxed);
+        }
+        if (drained)
+            futexWait(slot->doorbell, doorbell, bus_wait_timeout);
+    }
+}
+#else
+bool ChIRC::LocalBus::open(const std::string &name, int id, const std::string &nickname, Receiver receiver)
+{
+    std::cout << "ChIRC: The local bus is not supported on this platform" << std::endl;
+    return false;
+}
+
+void ChIRC::LocalBus::close()
+{
+}
+
+int ChIRC::LocalBus::broadcast(std::string_view record)
+{
+    return 0;
+}
+
+bool ChIRC::LocalBus::isLocal(int id) const
+{
+    return false;
+}
+#endif
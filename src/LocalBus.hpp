@@ -0,0 +1,115 @@
+#ifndef CH_LOCALBUS_HPP
+#define CH_LOCALBUS_HPP
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace ChIRC
+{
+constexpr uint32_t bus_version = 2;
+// Instances that can share one bus
+constexpr uint32_t bus_slots = 32;
+// Records a mailbox holds, a power of two
+constexpr uint32_t bus_mailbox_size = 64;
+constexpr size_t bus_record_size   = 256;
+// Milliseconds a claimed cell may stay unwritten before the owner skips it,
+// unless its writer is known to be dead
+constexpr int bus_writer_timeout = 1000;
+
+struct BusCell
+{
+    // 2 * lap while free, 2 * lap + 1 once written for that lap. Starts at
+    // zero, so a freshly truncated segment is a valid empty mailbox.
+    std::atomic<uint64_t> sequence;
+    // Process writing the cell, 0 while nobody is
+    std::atomic<uint32_t> writer;
+    int32_t sender;
+    uint16_t length;
+    char nickname[34];
+    char record[bus_record_size];
+};
+
+// Mailbox of one instance, many writers and the owner reading
+struct BusSlot
+{
+    // Owning process, 0 if the slot is free
+    std::atomic<uint32_t> pid;
+    // C&C id of the owner, 0 while the slot is being set up
+    std::atomic<int32_t> id;
+    // Bumped after every write, the owner sleeps on it as a futex
+    std::atomic<uint32_t> doorbell;
+    std::atomic<uint64_t> write;
+    std::atomic<uint64_t> read;
+    BusCell cells[bus_mailbox_size];
+};
+
+struct BusHeader
+{
+    char magic[8];
+    std::atomic<uint32_t> version;
+    BusSlot slots[bus_slots];
+};
+
+// Shared memory segment through which ChIRC instances on one host that use
+// the same server and C&C channel hand each other C&C records, without
+// going through the IRC server. Every instance owns a slot with a lock-free
+// mailbox and a thread waiting on it.
+class LocalBus
+{
+public:
+    // Called on the bus thread with a record and the IRC nickname of its
+    // sender
+    typedef std::function<void(std::string_view record, std::string_view nickname)> Receiver;
+
+    bool open(const std::string &name, int id, const std::string &nickname, Receiver receiver);
+    void close();
+    bool isOpen() const
+    {
+        return slot != nullptr;
+    }
+    // Puts record into every other instance's mailbox. Returns how many
+    // instances got it, full mailboxes are skipped.
+    int broadcast(std::string_view record);
+    // True if id is another instance on this bus
+    bool isLocal(int id) const;
+    // Nickname sent with our records from now on, for when ours changed on
+    // IRC. Only call from the thread calling broadcast().
+    void setNickname(std::string_view nickname)
+    {
+        this->nickname.assign(nickname.substr(0, sizeof(BusCell::nickname)));
+    }
+
+    LocalBus() = default;
+    LocalBus(const LocalBus &) = delete;
+    LocalBus &operator=(const LocalBus &) = delete;
+    ~LocalBus()
+    {
+        close();
+    }
+
+private:
+    void run();
+    bool claim(BusSlot &candidate);
+    // True if the unwritten cell at position should be skipped, its writer
+    // died or took too long
+    bool writerGone(const BusCell &cell, uint64_t position);
+
+    int fd{ -1 };
+    BusHeader *header{ nullptr };
+    BusSlot *slot{ nullptr };
+    int id{ 0 };
+    uint32_t pid{ 0 };
+    std::string nickname;
+    // First unwritten cell the bus thread waits on and since when
+    uint64_t stalled_position{ UINT64_MAX };
+    std::chrono::steady_clock::time_point stalled_since{};
+    Receiver receiver;
+    std::thread thread;
+    std::atomic<bool> running{ false };
+};
+} // namespace ChIRC
+#endif
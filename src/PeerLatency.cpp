@@ -0,0 +1,47 @@
+#include "PeerLatency.hpp"
+#include <algorithm>
+
+void ChIRC::PeerLatency::add(uint32_t seq, uint64_t sent, clock::time_point now)
+{
+    // Also came over another path
+    if (count && seq == last_seq)
+        return;
+    if (count && seq < last_seq)
+        *this = PeerLatency();
+    if (count)
+    {
+        lost += seq - last_seq - 1;
+        interval = double(sent) - double(last_sent);
+    }
+    deltas[count % latency_samples] = int64_t(stamp(now)) - int64_t(sent);
+    ++count;
+    ++received;
+    last_seq      = seq;
+    last_sent     = sent;
+    last_received = now;
+}
+
+ChIRC::PeerLatencyStats ChIRC::PeerLatency::stats(clock::time_point now, double transit) const
+{
+    PeerLatencyStats stats = {};
+    stats.received         = received;
+    stats.lost             = lost;
+    if (!count)
+        return stats;
+
+    uint32_t size = std::min(count, latency_samples);
+    int64_t sorted[latency_samples];
+    std::copy(deltas, deltas + size, sorted);
+    std::sort(sorted, sorted + size);
+
+    int64_t baseline = sorted[0];
+    stats.last       = double(deltas[(count - 1) % latency_samples] - baseline);
+    stats.p50        = double(sorted[size * 50 / 100] - baseline);
+    stats.p90        = double(sorted[size * 90 / 100] - baseline);
+    stats.p99        = double(sorted[size * 99 / 100] - baseline);
+    stats.offset     = double(baseline);
+    stats.interval   = interval;
+    stats.age        = std::chrono::duration<double, std::milli>(now - last_received).count() + stats.last + transit;
+    stats.samples    = size;
+    return stats;
+}
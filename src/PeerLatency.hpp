@@ -0,0 +1,67 @@
+#ifndef CH_PEERLATENCY_HPP
+#define CH_PEERLATENCY_HPP
+#include <chrono>
+#include <cstdint>
+
+namespace ChIRC
+{
+// Heartbeats kept per peer for the percentiles
+constexpr uint32_t latency_samples = 64;
+
+// How current the heartbeats of one peer are, in milliseconds. Our clocks
+// are not synchronized with the peer's, so transit times are measured
+// against the quickest heartbeat seen recently: offset is that baseline and
+// the delays are how much later than it a heartbeat arrived, i.e. the time
+// it spent queued in the sender's throttle or on the server.
+struct PeerLatencyStats
+{
+    double last;
+    double p50;
+    double p90;
+    double p99;
+    // Our clock minus the peer's, plus the quickest transit
+    double offset;
+    // Time between the sender's last two heartbeats by its own clock, above
+    // the heartbeat period when the sender stalls
+    double interval;
+    // How old the newest heartbeat is: the time since we got it, its delay
+    // and an estimate of the transit the baseline can't show
+    double age;
+    unsigned samples;
+    // Heartbeats received and skipped going by their sequence numbers
+    uint32_t received;
+    uint32_t lost;
+};
+
+// Heartbeats of one peer, stamped by it with a sequence number and the time
+// they were sent
+class PeerLatency
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // Milliseconds on the steady clock, what heartbeats are stamped with
+    static uint64_t stamp(clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+
+    // Adds a heartbeat sent at sent by the peer's clock. A sequence number
+    // that went backwards means the peer restarted and starts over.
+    void add(uint32_t seq, uint64_t sent, clock::time_point now);
+    // transit is added to the age for what the baseline does not cover
+    PeerLatencyStats stats(clock::time_point now, double transit) const;
+
+private:
+    // Our receive time minus the peer's send time
+    int64_t deltas[latency_samples];
+    uint32_t count{ 0 };
+    uint32_t last_seq{ 0 };
+    uint64_t last_sent{ 0 };
+    double interval{ 0 };
+    uint32_t received{ 0 };
+    uint32_t lost{ 0 };
+    clock::time_point last_received{};
+};
+} // namespace ChIRC
+#endif
@@ -0,0 +1,132 @@
+#include "ChIRC.hpp"
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+constexpr char snapshot_magic[8] = "CHIRCPT";
+constexpr size_t snapshot_size   = sizeof(ChIRC::SnapshotHeader) + sizeof(ChIRC::SnapshotEntry) * ChIRC::snapshot_capacity;
+
+static ChIRC::SnapshotEntry *entries(ChIRC::SnapshotHeader *header)
+{
+    return reinterpret_cast<ChIRC::SnapshotEntry *>(header + 1);
+}
+
+#ifndef _WIN32
+bool ChIRC::PeerSnapshot::open(const char *path)
+{
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || ftruncate(fd, snapshot_size) == -1)
+    {
+        std::cout << "ChIRC: Unable to open peer snapshot " << path << std::endl;
+        close();
+        return false;
+    }
+    void *map = mmap(nullptr, snapshot_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        std::cout << "ChIRC: Unable to map peer snapshot " << path << std::endl;
+        close();
+        return false;
+    }
+    header = static_cast<SnapshotHeader *>(map);
+    // New file or written by an incompatible version, start over
+    if (memcmp(header->magic, snapshot_magic, sizeof(snapshot_magic)) || header->version != snapshot_version || header->capacity != snapshot_capacity)
+    {
+        memset(header, 0, sizeof(SnapshotHeader));
+        memcpy(header->magic, snapshot_magic, sizeof(snapshot_magic));
+        header->version  = snapshot_version;
+        header->capacity = snapshot_capacity;
+    }
+    return true;
+}
+
+void ChIRC::PeerSnapshot::close()
+{
+    if (header)
+    {
+        munmap(header, snapshot_size);
+        header = nullptr;
+    }
+    if (fd != -1)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+#else
+bool ChIRC::PeerSnapshot::open(const char *path)
+{
+    std::cout << "ChIRC: Peer snapshots are not supported on this platform" << std::endl;
+    return false;
+}
+
+void ChIRC::PeerSnapshot::close()
+{
+}
+#endif
+
+int ChIRC::PeerSnapshot::loadID() const
+{
+    return header ? header->id : 0;
+}
+
+void ChIRC::PeerSnapshot::load(std::unordered_map<int, PeerData> &out) const
+{
+    if (!header)
+        return;
+    auto now     = Timer::clock::now();
+    uint32_t end = std::min(header->count, snapshot_capacity);
+    for (uint32_t i = 0; i < end; i++)
+    {
+        const SnapshotEntry &entry = entries(header)[i];
+        PeerData peer{};
+        // Wall clock times do not survive a restart, count from now
+        peer.heartbeat  = now;
+        peer.nickname   = std::string(entry.nickname, strnlen(entry.nickname, sizeof(entry.nickname)));
+        peer.is_bot     = entry.is_bot;
+        peer.party_size = entry.party_size;
+        peer.is_ingame  = entry.is_ingame;
+        peer.steamid    = entry.steamid;
+        peer.caps       = entry.caps;
+        out[entry.id]   = std::move(peer);
+    }
+}
+
+static bool storeEntry(ChIRC::SnapshotEntry &entry, int id, unsigned int steamid, int party_size, bool is_bot, bool is_ingame, unsigned caps, std::string_view nickname)
+{
+    if (nickname.size() > sizeof(entry.nickname))
+        return false;
+    entry.id         = id;
+    entry.steamid    = steamid;
+    entry.party_size = party_size;
+    entry.is_bot     = is_bot;
+    entry.is_ingame  = is_ingame;
+    entry.caps       = caps;
+    memset(entry.nickname, 0, sizeof(entry.nickname));
+    memcpy(entry.nickname, nickname.data(), nickname.size());
+    return true;
+}
+
+void ChIRC::PeerSnapshot::store(int id, const PeerTable &peers, const std::unordered_map<int, PeerData> &dormant)
+{
+    if (!header)
+        return;
+    uint32_t count = 0;
+    peers.forEach([&](uint32_t row) {
+        if (count < snapshot_capacity && storeEntry(entries(header)[count], peers.id(row), peers.steamid(row), peers.party_size(row), peers.is_bot(row), peers.is_ingame(row), peers.caps(row), peers.nickname(row)))
+            count++;
+    });
+    for (auto &i : dormant)
+    {
+        if (count == snapshot_capacity)
+            break;
+        if (storeEntry(entries(header)[count], i.first, i.second.steamid, i.second.party_size, i.second.is_bot, i.second.is_ingame, i.second.caps, i.second.nickname))
+            count++;
+    }
+    header->id    = id;
+    header->count = count;
+}
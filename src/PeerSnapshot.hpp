@@ -0,0 +1,66 @@
+#ifndef CH_PEERSNAPSHOT_HPP
+#define CH_PEERSNAPSHOT_HPP
+#include <cstdint>
+#include <unordered_map>
+
+namespace ChIRC
+{
+struct PeerData;
+class PeerTable;
+
+constexpr uint32_t snapshot_version  = 3;
+constexpr uint32_t snapshot_capacity = 1024;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    // Our own C&C id, 0 if never stored
+    int32_t id;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct SnapshotEntry
+{
+    int32_t id;
+    uint32_t steamid;
+    int32_t party_size;
+    uint8_t is_bot;
+    uint8_t is_ingame;
+    uint8_t caps;
+    // NUL padded, not terminated if it takes the whole field. Peers with
+    // longer nicknames are not stored, a cut one would never match the nick
+    // a dormant peer is revived under.
+    char nickname[64];
+};
+
+// Small memory mapped file keeping our id and the peer table across process
+// restarts. Restored peers still have to send a heartbeat before they show up
+// in getPeers() again, but they do not need a new auth round.
+class PeerSnapshot
+{
+    int fd{ -1 };
+    SnapshotHeader *header{ nullptr };
+
+public:
+    bool open(const char *path);
+    void close();
+    bool isOpen() const
+    {
+        return header != nullptr;
+    }
+    int loadID() const;
+    void load(std::unordered_map<int, PeerData> &out) const;
+    void store(int id, const PeerTable &peers, const std::unordered_map<int, PeerData> &dormant);
+
+    PeerSnapshot() = default;
+    PeerSnapshot(const PeerSnapshot &) = delete;
+    PeerSnapshot &operator=(const PeerSnapshot &) = delete;
+    ~PeerSnapshot()
+    {
+        close();
+    }
+};
+} // namespace ChIRC
+#endif
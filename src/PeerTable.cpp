@@ -0,0 +1,289 @@
+#include "PeerTable.hpp"
+
+uint32_t ChIRC::NicknamePool::intern(std::string_view nickname)
+{
+    auto found = lookup.find(nickname);
+    if (found != lookup.end())
+    {
+        refs[found->second]++;
+        return found->second;
+    }
+    uint32_t index;
+    if (!free_slots.empty())
+    {
+        index = free_slots.back();
+        free_slots.pop_back();
+        strings[index].assign(nickname);
+        refs[index] = 1;
+    }
+    else
+    {
+        index = strings.size();
+        strings.emplace_back(nickname);
+        refs.push_back(1);
+    }
+    lookup.emplace(strings[index], index);
+    return index;
+}
+
+void ChIRC::NicknamePool::release(uint32_t index)
+{
+    if (--refs[index])
+        return;
+    lookup.erase(strings[index]);
+    strings[index].clear();
+    free_slots.push_back(index);
+}
+
+bool ChIRC::NicknamePool::find(std::string_view nickname, uint32_t &index) const
+{
+    auto found = lookup.find(nickname);
+    if (found == lookup.end())
+        return false;
+    index = found->second;
+    return true;
+}
+
+void ChIRC::PeerTable::link(uint32_t row)
+{
+    by_id[ids[row]] = row;
+    if (steamids[row])
+        by_steamid.emplace(steamids[row], row);
+    by_nickname[nicknames[row]] = row;
+    if (ingame_flags[row])
+    {
+        ingame_slots[row] = ingame.size();
+        ingame.push_back(row);
+    }
+    joinParty(row);
+}
+
+void ChIRC::PeerTable::unlink(uint32_t row)
+{
+    by_id.erase(ids[row]);
+    if (steamids[row])
+    {
+        auto range = by_steamid.equal_range(steamids[row]);
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            if (i->second == row)
+            {
+                by_steamid.erase(i);
+                break;
+            }
+        }
+    }
+    by_nickname.erase(nicknames[row]);
+    nickname_pool.release(nicknames[row]);
+    setIngame(row, false);
+    leaveParty(row);
+}
+
+// Moves an unlinked row's worth of columns and repoints the indexes
+void ChIRC::PeerTable::moveRow(uint32_t from, uint32_t to)
+{
+    ids[to]          = ids[from];
+    heartbeats[to]   = heartbeats[from];
+    steamids[to]     = steamids[from];
+    party_sizes[to]  = party_sizes[from];
+    nicknames[to]    = nicknames[from];
+    bots[to]         = bots[from];
+    ingame_flags[to] = ingame_flags[from];
+    capabilities[to] = capabilities[from];
+    ingame_slots[to] = ingame_slots[from];
+    party_slots[to]  = party_slots[from];
+
+    by_id[ids[to]] = to;
+    if (steamids[to])
+    {
+        auto range = by_steamid.equal_range(steamids[to]);
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            if (i->second == from)
+            {
+                i->second = to;
+                break;
+            }
+        }
+    }
+    by_nickname[nicknames[to]] = to;
+    if (ingame_flags[to])
+        ingame[ingame_slots[to]] = to;
+    by_party_size[party_sizes[to]][party_slots[to]] = to;
+}
+
+void ChIRC::PeerTable::setIngame(uint32_t row, bool is_ingame)
+{
+    if (ingame_flags[row] == is_ingame)
+        return;
+    ingame_flags[row] = is_ingame;
+    if (is_ingame)
+    {
+        ingame_slots[row] = ingame.size();
+        ingame.push_back(row);
+        return;
+    }
+    uint32_t last             = ingame.back();
+    ingame[ingame_slots[row]] = last;
+    ingame_slots[last]        = ingame_slots[row];
+    ingame.pop_back();
+}
+
+void ChIRC::PeerTable::joinParty(uint32_t row)
+{
+    auto &bucket     = by_party_size[party_sizes[row]];
+    party_slots[row] = bucket.size();
+    bucket.push_back(row);
+}
+
+void ChIRC::PeerTable::leaveParty(uint32_t row)
+{
+    auto bucket                      = by_party_size.find(party_sizes[row]);
+    uint32_t last                    = bucket->second.back();
+    bucket->second[party_slots[row]] = last;
+    party_slots[last]                = party_slots[row];
+    bucket->second.pop_back();
+    if (bucket->second.empty())
+        by_party_size.erase(bucket);
+}
+
+void ChIRC::PeerTable::setPartySize(uint32_t row, int party_size)
+{
+    if (party_sizes[row] == party_size)
+        return;
+    leaveParty(row);
+    party_sizes[row] = party_size;
+    joinParty(row);
+}
+
+int ChIRC::PeerTable::evictNickname(std::string_view nickname, int id, PeerData &evicted)
+{
+    // A nickname belongs to one client at a time, whoever had it before is
+    // gone from IRC and only waited for its timeout
+    uint32_t previous = findByNickname(nickname);
+    if (previous == npos || ids[previous] == id)
+        return 0;
+    int previous_id = ids[previous];
+    extract(previous_id, evicted);
+    return previous_id;
+}
+
+int ChIRC::PeerTable::insert(int id, const PeerData &peer, PeerData &evicted)
+{
+    erase(id);
+    int previous = evictNickname(peer.nickname, id, evicted);
+    uint32_t row = ids.size();
+    ids.push_back(id);
+    heartbeats.push_back(peer.heartbeat);
+    steamids.push_back(peer.steamid);
+    party_sizes.push_back(peer.party_size);
+    nicknames.push_back(nickname_pool.intern(peer.nickname));
+    bots.push_back(peer.is_bot);
+    ingame_flags.push_back(peer.is_ingame);
+    capabilities.push_back(peer.caps);
+    ingame_slots.push_back(0);
+    party_slots.push_back(0);
+    link(row);
+    return previous;
+}
+
+int ChIRC::PeerTable::rename(int id, std::string_view nickname, PeerData &evicted)
+{
+    if (find(id) == npos)
+        return 0;
+    int previous = evictNickname(nickname, id, evicted);
+    // Looked up again, the eviction may have moved the row
+    uint32_t row = find(id);
+    by_nickname.erase(nicknames[row]);
+    nickname_pool.release(nicknames[row]);
+    nicknames[row]              = nickname_pool.intern(nickname);
+    by_nickname[nicknames[row]] = row;
+    return previous;
+}
+
+bool ChIRC::PeerTable::erase(int id)
+{
+    uint32_t row = find(id);
+    if (row == npos)
+        return false;
+    unlink(row);
+    uint32_t last = ids.size() - 1;
+    if (row != last)
+        moveRow(last, row);
+    ids.pop_back();
+    heartbeats.pop_back();
+    steamids.pop_back();
+    party_sizes.pop_back();
+    nicknames.pop_back();
+    bots.pop_back();
+    ingame_flags.pop_back();
+    capabilities.pop_back();
+    ingame_slots.pop_back();
+    party_slots.pop_back();
+    return true;
+}
+
+bool ChIRC::PeerTable::extract(int id, PeerData &out)
+{
+    uint32_t row = find(id);
+    if (row == npos)
+        return false;
+    out = get(row);
+    return erase(id);
+}
+
+bool ChIRC::PeerTable::update(int id, std::chrono::time_point<Timer::clock> heartbeat, int party_size, bool is_ingame)
+{
+    uint32_t row = find(id);
+    if (row == npos)
+        return false;
+    heartbeats[row] = heartbeat;
+    setPartySize(row, party_size);
+    setIngame(row, is_ingame);
+    return true;
+}
+
+uint32_t ChIRC::PeerTable::find(int id) const
+{
+    auto found = by_id.find(id);
+    return found != by_id.end() ? found->second : npos;
+}
+
+uint32_t ChIRC::PeerTable::findBySteamID(unsigned int steamid) const
+{
+    if (!steamid)
+        return npos;
+    auto found = by_steamid.find(steamid);
+    return found != by_steamid.end() ? found->second : npos;
+}
+
+uint32_t ChIRC::PeerTable::findByNickname(std::string_view nickname) const
+{
+    uint32_t index;
+    if (!nickname_pool.find(nickname, index))
+        return npos;
+    auto found = by_nickname.find(index);
+    return found != by_nickname.end() ? found->second : npos;
+}
+
+ChIRC::PeerData ChIRC::PeerTable::get(uint32_t row) const
+{
+    PeerData peer;
+    peer.heartbeat  = heartbeats[row];
+    peer.nickname   = nickname(row);
+    peer.is_bot     = bots[row];
+    peer.party_size = party_sizes[row];
+    peer.is_ingame  = ingame_flags[row];
+    peer.steamid    = steamids[row];
+    peer.caps       = capabilities[row];
+    return peer;
+}
+
+std::unordered_map<int, ChIRC::PeerData> ChIRC::PeerTable::toMap() const
+{
+    std::unordered_map<int, PeerData> out;
+    out.reserve(ids.size());
+    for (uint32_t row = 0; row < ids.size(); row++)
+        out.emplace(ids[row], get(row));
+    return out;
+}
@@ -0,0 +1,174 @@
+#ifndef CH_PEERTABLE_HPP
+#define CH_PEERTABLE_HPP
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "timer.hpp"
+
+namespace ChIRC
+{
+// Used for storing data of C&C clients
+struct PeerData
+{
+    std::chrono::time_point<Timer::clock> heartbeat{};
+    std::string nickname;
+    bool is_bot          = false;
+    int party_size       = -1;
+    bool is_ingame       = false;
+    unsigned int steamid = 0;
+    // peer_caps bits from its auth
+    unsigned caps = 0;
+};
+
+// Every distinct nickname is stored once and referred to by a small index
+class NicknamePool
+{
+    // A deque never moves its elements, so the views in lookup stay valid
+    std::deque<std::string> strings;
+    std::vector<uint32_t> refs;
+    std::vector<uint32_t> free_slots;
+    std::unordered_map<std::string_view, uint32_t> lookup;
+
+public:
+    // Returns the index of nickname and takes a reference on it
+    uint32_t intern(std::string_view nickname);
+    void release(uint32_t index);
+    bool find(std::string_view nickname, uint32_t &index) const;
+    std::string_view get(uint32_t index) const
+    {
+        return strings[index];
+    }
+};
+
+// Peer table stored as one array per field. A row is valid until the table is
+// next modified, removing a peer moves the last row into its place so the
+// columns stay dense. The indexes below are kept up to date on every change,
+// so lookups by steamid or nickname and the in-game and party size filters
+// never scan the whole table.
+class PeerTable
+{
+    std::vector<int> ids;
+    std::vector<std::chrono::time_point<Timer::clock>> heartbeats;
+    std::vector<unsigned int> steamids;
+    std::vector<int> party_sizes;
+    std::vector<uint32_t> nicknames;
+    std::vector<uint8_t> bots;
+    std::vector<uint8_t> ingame_flags;
+    std::vector<uint8_t> capabilities;
+    // Position of each row in ingame and its by_party_size bucket
+    std::vector<uint32_t> ingame_slots;
+    std::vector<uint32_t> party_slots;
+
+    std::unordered_map<int, uint32_t> by_id;
+    // steamid 0 means unknown and is not indexed
+    std::unordered_multimap<unsigned int, uint32_t> by_steamid;
+    std::unordered_map<uint32_t, uint32_t> by_nickname;
+    // Rows of peers that are in game
+    std::vector<uint32_t> ingame;
+    // Rows by party size, ordered so "smaller than n" is a prefix
+    std::map<int, std::vector<uint32_t>> by_party_size;
+    NicknamePool nickname_pool;
+
+    void link(uint32_t row);
+    void unlink(uint32_t row);
+    void moveRow(uint32_t from, uint32_t to);
+    void setIngame(uint32_t row, bool is_ingame);
+    void joinParty(uint32_t row);
+    void leaveParty(uint32_t row);
+    void setPartySize(uint32_t row, int party_size);
+    // Removes the peer other than id holding nickname, see insert()
+    int evictNickname(std::string_view nickname, int id, PeerData &evicted);
+
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    size_t size() const
+    {
+        return ids.size();
+    }
+    bool empty() const
+    {
+        return ids.empty();
+    }
+
+    // Adds the peer or replaces what we had for id. Every nickname maps to
+    // one row, so another peer with the same nickname is removed: returns
+    // its id with its data in evicted, 0 if there was none.
+    int insert(int id, const PeerData &peer, PeerData &evicted);
+    // Gives peer id a new nickname, for a NICK change. Evicts like insert().
+    int rename(int id, std::string_view nickname, PeerData &evicted);
+    bool erase(int id);
+    // Removes the peer and hands out its data
+    bool extract(int id, PeerData &out);
+    // Applies a heartbeat, false if id is unknown
+    bool update(int id, std::chrono::time_point<Timer::clock> heartbeat, int party_size, bool is_ingame);
+
+    uint32_t find(int id) const;
+    // First peer with this steamid
+    uint32_t findBySteamID(unsigned int steamid) const;
+    uint32_t findByNickname(std::string_view nickname) const;
+
+    int id(uint32_t row) const
+    {
+        return ids[row];
+    }
+    std::chrono::time_point<Timer::clock> heartbeat(uint32_t row) const
+    {
+        return heartbeats[row];
+    }
+    unsigned int steamid(uint32_t row) const
+    {
+        return steamids[row];
+    }
+    int party_size(uint32_t row) const
+    {
+        return party_sizes[row];
+    }
+    bool is_bot(uint32_t row) const
+    {
+        return bots[row];
+    }
+    bool is_ingame(uint32_t row) const
+    {
+        return ingame_flags[row];
+    }
+    unsigned caps(uint32_t row) const
+    {
+        return capabilities[row];
+    }
+    std::string_view nickname(uint32_t row) const
+    {
+        return nickname_pool.get(nicknames[row]);
+    }
+    PeerData get(uint32_t row) const;
+
+    // f(row) for every peer
+    template <typename F> void forEach(F &&f) const
+    {
+        for (uint32_t row = 0; row < ids.size(); row++)
+            f(row);
+    }
+    // f(row) for every peer that is in game
+    template <typename F> void forEachIngame(F &&f) const
+    {
+        for (uint32_t row : ingame)
+            f(row);
+    }
+    // f(row) for every peer with party_size < n, peers that never reported
+    // a party size have -1
+    template <typename F> void forEachPartySizeBelow(int n, F &&f) const
+    {
+        for (auto i = by_party_size.begin(); i != by_party_size.end() && i->first < n; ++i)
+            for (uint32_t row : i->second)
+                f(row);
+    }
+
+    std::unordered_map<int, PeerData> toMap() const;
+};
+} // namespace ChIRC
+#endif
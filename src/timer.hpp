@@ -7,12 +7,39 @@
 
 #ifndef   CH_TIMER_HPP
 #define   CH_TIMER_HPP
+#include <array>
 #include <chrono>
+#include <cstddef>
+#ifdef CH_TIMER_COARSE
+#include <time.h>
+
+// CLOCK_MONOTONIC_COARSE, only as precise as the scheduler tick but reading
+// it is a lot cheaper than the precise clocks
+struct coarse_clock
+{
+    typedef std::chrono::nanoseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<coarse_clock> time_point;
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return time_point(std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec));
+    }
+};
+#endif
 
 class Timer
 {
 public:
-    typedef std::chrono::system_clock clock;
+#ifdef CH_TIMER_COARSE
+    typedef coarse_clock clock;
+#else
+    typedef std::chrono::steady_clock clock;
+#endif
 
     inline Timer(){};
 
@@ -37,4 +64,46 @@ public:
 public:
     std::chrono::time_point<clock> last{};
 };
+
+// Fixed set of deadlines that all work off one clock read per tick()
+template <size_t N> class TimerQueue
+{
+public:
+    typedef Timer::clock clock;
+
+    // Reads the clock, every check until the next tick uses this time
+    inline clock::time_point tick()
+    {
+        current = clock::now();
+        return current;
+    }
+    inline clock::time_point now() const
+    {
+        return current;
+    }
+    inline bool check(size_t timer) const
+    {
+        return current >= deadlines[timer];
+    }
+    // Fires once the deadline has passed and sets the next one ms from now
+    inline bool test_and_set(size_t timer, unsigned ms)
+    {
+        if (!check(timer))
+            return false;
+        schedule(timer, ms);
+        return true;
+    }
+    inline void schedule(size_t timer, unsigned ms)
+    {
+        deadlines[timer] = current + std::chrono::milliseconds(ms);
+    }
+    inline clock::time_point deadline(size_t timer) const
+    {
+        return deadlines[timer];
+    }
+
+private:
+    clock::time_point current{};
+    std::array<clock::time_point, N> deadlines{};
+};
 #endif